@@ -5,53 +5,84 @@
  * Copyright (C) 2006-2018 Oracle Corporation
  */
 
+#include <linux/ctype.h>
+#include <linux/log2.h>
 #include <linux/namei.h>
+#include <linux/stringhash.h>
 #include <linux/vbox_utils.h>
+#include <linux/wait_bit.h>
 #include "vfsmod.h"
 
-static int vboxsf_dir_open(struct inode *inode, struct file *file)
+/* Lookups per second after which a dir gets answered from its listing */
+#define VBOXSF_HOT_DIR_LOOKUPS 32
+/* Bigger listings are not kept for lookups + retry delay when too big */
+#define VBOXSF_LOOKUP_DIR_MAX_ENTRIES 16384
+#define VBOXSF_LOOKUP_DIR_BACKOFF (60 * HZ)
+/* d_fsdata of a negative dentry which is being revalidated */
+#define VBOXSF_NEG_STAT_BUSY ((void *)1)
+
+/* Read the listing of the directory @dentry from the host into @sf_d */
+static int vboxsf_dir_fetch(struct dentry *dentry,
+			    struct vboxsf_dir_info *sf_d,
+			    enum vboxsf_io_class class)
 {
-	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
 	struct shfl_createparms params = {};
-	struct vboxsf_dir_info *sf_d;
+	u32 client_idx;
 	int err;
 
-	sf_d = vboxsf_dir_info_alloc();
-	if (!sf_d)
-		return -ENOMEM;
-
 	params.handle = SHFL_HANDLE_NIL;
 	params.create_flags = SHFL_CF_DIRECTORY | SHFL_CF_ACT_OPEN_IF_EXISTS |
 			      SHFL_CF_ACT_FAIL_IF_NEW | SHFL_CF_ACCESS_READ;
 
-	err = vboxsf_create_at_dentry(file_dentry(file), &params);
+	err = vboxsf_create_at_dentry(dentry, &params, &client_idx);
 	if (err)
-		goto err_free_dir_info;
+		return err;
 
-	if (params.result != SHFL_FILE_EXISTS) {
+	if (params.result == SHFL_FILE_EXISTS)
+		err = vboxsf_dir_read_all(sbi, sf_d, client_idx, params.handle,
+					  class);
+	else
 		err = -ENOENT;
-		goto err_close;
+
+	vboxsf_close(sbi->root, client_idx, params.handle);
+	return err;
+}
+
+static int vboxsf_dir_open(struct inode *inode, struct file *file)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct vboxsf_dir_info *sf_d;
+	int err;
+
+	if (sbi->o.exclusive) {
+		sf_d = vboxsf_dir_cache_get(inode);
+		if (sf_d) {
+			file->private_data = sf_d;
+			return 0;
+		}
 	}
 
-	err = vboxsf_dir_read_all(sbi, sf_d, params.handle);
-	if (err)
-		goto err_close;
+	sf_d = vboxsf_dir_info_alloc();
+	if (!sf_d)
+		return -ENOMEM;
+
+	err = vboxsf_dir_fetch(file_dentry(file), sf_d, vboxsf_io_sync_meta);
+	if (err) {
+		vboxsf_dir_info_free(sf_d);
+		return err;
+	}
 
-	vboxsf_close(sbi->root, params.handle);
+	if (sbi->o.exclusive)
+		vboxsf_dir_cache_set(inode, sf_d);
 	file->private_data = sf_d;
 	return 0;
-
-err_close:
-	vboxsf_close(sbi->root, params.handle);
-err_free_dir_info:
-	vboxsf_dir_info_free(sf_d);
-	return err;
 }
 
 static int vboxsf_dir_release(struct inode *inode, struct file *file)
 {
 	if (file->private_data)
-		vboxsf_dir_info_free(file->private_data);
+		vboxsf_dir_info_put(file->private_data);
 
 	return 0;
 }
@@ -178,19 +209,115 @@ const struct file_operations vboxsf_dir_fops = {
 	.llseek = generic_file_llseek,
 };
 
+static int vboxsf_dir_lookup_listing(struct dentry *parent,
+				     struct dentry *dentry,
+				     struct shfl_fsobjinfo *fsinfo,
+				     unsigned long *attr_time);
+
 /*
  * This is called during name resolution/lookup to check if the @dentry in
  * the cache is still valid. the job is handled by vboxsf_inode_revalidate.
  */
 static int vboxsf_dentry_revalidate(struct dentry *dentry, unsigned int flags)
 {
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
+	struct inode *inode = d_inode_rcu(dentry);
+	unsigned long d_time, attr_time;
+	struct shfl_fsobjinfo fsinfo;
+	struct dentry *parent;
+	bool busy;
+	int err, valid;
+
+	/*
+	 * Intermediate directories of a path walk only need to still exist.
+	 * The host resolves the full path of the final operation and every
+	 * successful host operation on a descendant proves the ancestors,
+	 * see vboxsf_dentry_prove_path(), so there is no need to stat them
+	 * one by one. Their attributes get revalidated when they are the
+	 * last component themselves. This also works in RCU walk mode.
+	 */
+	if ((flags & LOOKUP_PARENT) && inode && S_ISDIR(inode->i_mode) &&
+	    !READ_ONCE(VBOXSF_I(inode)->force_restat) &&
+	    time_before(jiffies, READ_ONCE(dentry->d_time) + sbi->o.ttl))
+		return 1;
+
+	/*
+	 * Symlinks whose attributes are less than ttl old pass in RCU walk
+	 * mode too, so that their cached target can be followed without
+	 * leaving it, see vboxsf_get_link().
+	 */
+	if ((flags & LOOKUP_RCU) && inode && S_ISLNK(inode->i_mode) &&
+	    !READ_ONCE(VBOXSF_I(inode)->force_restat) &&
+	    time_before(jiffies, READ_ONCE(VBOXSF_I(inode)->attr_time) +
+				 sbi->o.ttl)) {
+		vboxsf_stats_inc(sbi, attr_hits);
+		return 1;
+	}
+
 	if (flags & LOOKUP_RCU)
 		return -ECHILD;
 
 	if (d_really_is_positive(dentry))
 		return vboxsf_inode_revalidate(dentry) == 0;
-	else
-		return vboxsf_stat_dentry(dentry, NULL) == -ENOENT;
+
+	/* With exclusive mounts negative dentries stay valid too */
+	if (vboxsf_exclusive_valid(dentry)) {
+		vboxsf_stats_inc(sbi, neg_dentry_hits);
+		return 1;
+	}
+
+	/* Lookup-heavy parents answer from their listing like lookups do */
+	parent = dget_parent(dentry);
+	err = vboxsf_dir_lookup_listing(parent, dentry, &fsinfo, &attr_time);
+	dput(parent);
+	if (err != -EAGAIN) {
+		valid = err == -ENOENT;
+		if (valid) {
+			WRITE_ONCE(dentry->d_time, jiffies);
+			vboxsf_stats_inc(sbi, neg_dentry_hits);
+		}
+		return valid;
+	}
+
+	/*
+	 * When many tasks revalidate the same negative dentry at once (e.g.
+	 * compilers probing include paths), only one of them does the stat
+	 * and the others wait for it, like the stat_gen singleflight for
+	 * inodes. d_fsdata marks the stat in flight and d_time is the
+	 * generation: if it changed the dentry was found to still be negative,
+	 * otherwise the name exists now (or the stat failed).
+	 */
+	d_time = READ_ONCE(dentry->d_time);
+
+	spin_lock(&dentry->d_lock);
+	busy = dentry->d_fsdata == VBOXSF_NEG_STAT_BUSY;
+	if (!busy)
+		dentry->d_fsdata = VBOXSF_NEG_STAT_BUSY;
+	spin_unlock(&dentry->d_lock);
+
+	if (busy) {
+		wait_var_event(&dentry->d_fsdata,
+			       READ_ONCE(dentry->d_fsdata) !=
+			       VBOXSF_NEG_STAT_BUSY);
+		valid = READ_ONCE(dentry->d_time) != d_time;
+		if (valid)
+			vboxsf_stats_inc(sbi, neg_dentry_hits);
+		return valid;
+	}
+
+	vboxsf_stats_inc(sbi, neg_dentry_misses);
+	valid = vboxsf_stat_dentry(dentry, NULL) == -ENOENT;
+	if (valid)
+		WRITE_ONCE(dentry->d_time, jiffies);
+
+	spin_lock(&dentry->d_lock);
+	dentry->d_fsdata = NULL;
+	spin_unlock(&dentry->d_lock);
+	/* Order the d_fsdata store before checking for waiters */
+	smp_mb();
+	wake_up_var(&dentry->d_fsdata);
+
+	return valid;
 }
 
 const struct dentry_operations vboxsf_dentry_ops = {
@@ -199,24 +326,363 @@ const struct dentry_operations vboxsf_dentry_ops = {
 
 /* iops */
 
+/*
+ * Lookup-heavy directories (include dirs, site-packages, node_modules) see
+ * many more lookups, most of them misses, than they have entries. Once a
+ * directory gets VBOXSF_HOT_DIR_LOOKUPS lookups within a second we read its
+ * listing once in the background, as a prefetch which nobody waits for, and
+ * answer further lookups from a name index of it for as
+ * long as the directory's mtime, which gets revalidated by the path walk,
+ * is unchanged. Local changes to the directory drop the listing.
+ *
+ * The hash is case folded so that the same index can be used for case
+ * insensitive hosts, on which only ASCII case differences are matched.
+ */
+static unsigned int vboxsf_dir_name_hash(const unsigned char *name,
+					 unsigned int len)
+{
+	unsigned long hash = init_name_hash(NULL);
+
+	while (len--)
+		hash = partial_name_hash(tolower(*name++), hash);
+
+	return end_name_hash(hash);
+}
+
+static int vboxsf_dir_build_index(struct vboxsf_dir_info *sf_d)
+{
+	struct shfl_dirinfo *info;
+	struct vboxsf_dir_buf *b;
+	size_t i, size, entries = 0;
+	unsigned int h, slots;
+
+	list_for_each_entry(b, &sf_d->info_list, head)
+		entries += b->entries;
+
+	if (entries > VBOXSF_LOOKUP_DIR_MAX_ENTRIES)
+		return -E2BIG;
+
+	/* Keep the index at most half full */
+	slots = roundup_pow_of_two(max_t(size_t, entries * 2, 2));
+	sf_d->index = kvcalloc(slots, sizeof(*sf_d->index), GFP_KERNEL);
+	if (!sf_d->index)
+		return -ENOMEM;
+
+	sf_d->index_mask = slots - 1;
+
+	/* See vboxsf_dir_emit() for the unaligned info pointer */
+	list_for_each_entry(b, &sf_d->info_list, head) {
+		for (i = 0, info = b->buf; i < b->entries; i++) {
+			h = vboxsf_dir_name_hash(info->name.string.utf8,
+						 info->name.length);
+			while (sf_d->index[h & sf_d->index_mask])
+				h++;
+			sf_d->index[h & sf_d->index_mask] = info;
+
+			size = offsetof(struct shfl_dirinfo, name.string) +
+			       info->name.size;
+			info = (struct shfl_dirinfo *)((uintptr_t)info + size);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the entry for @name, NULL if the directory has no such entry, or
+ * ERR_PTR(-EAGAIN) if the listing cannot tell because a case insensitive
+ * host may match non ASCII names we cannot fold.
+ */
+static struct shfl_dirinfo *vboxsf_dir_index_find(struct vboxsf_sbi *sbi,
+						  struct vboxsf_dir_info *sf_d,
+						  const struct qstr *name)
+{
+	unsigned int h = vboxsf_dir_name_hash(name->name, name->len);
+	struct shfl_dirinfo *info;
+	unsigned int i;
+
+	while ((info = sf_d->index[h & sf_d->index_mask])) {
+		if (info->name.length == name->len &&
+		    (sbi->case_sensitive ?
+		     !memcmp(info->name.string.utf8, name->name, name->len) :
+		     !strncasecmp((const char *)info->name.string.utf8,
+				  (const char *)name->name, name->len)))
+			return info;
+		h++;
+	}
+
+	if (!sbi->case_sensitive) {
+		for (i = 0; i < name->len; i++) {
+			if (!isascii(name->name[i]))
+				return ERR_PTR(-EAGAIN);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Count a lookup or child revalidation in @sf_i, returns true once the
+ * directory is busy enough to be served from a listing.
+ */
+static bool vboxsf_dir_lookup_hot(struct vboxsf_inode *sf_i)
+{
+	unsigned long now = jiffies;
+
+	/* lookup_window is in the future after a too big listing */
+	if (time_before(now, sf_i->lookup_window))
+		return false;
+
+	if (time_after(now, sf_i->lookup_window + HZ)) {
+		sf_i->lookup_window = now;
+		sf_i->lookup_count = 0;
+	}
+
+	return ++sf_i->lookup_count >= VBOXSF_HOT_DIR_LOOKUPS;
+}
+
+struct vboxsf_lookup_fetch {
+	struct work_struct work;
+	struct dentry *dentry;
+	unsigned long gen;
+};
+
+/* Read and index the listing of a dir, install it unless dropped meanwhile */
+static void vboxsf_lookup_dir_work(struct work_struct *work)
+{
+	struct vboxsf_lookup_fetch *f =
+		container_of(work, struct vboxsf_lookup_fetch, work);
+	struct inode *dir = d_inode(f->dentry);
+	struct vboxsf_inode *sf_i = VBOXSF_I(dir);
+	struct vboxsf_dir_info *sf_d, *old = NULL;
+	int err = -ENOMEM;
+
+	sf_d = vboxsf_dir_info_alloc();
+	if (sf_d) {
+		sf_d->mtime = dir->i_mtime;
+		err = vboxsf_dir_fetch(f->dentry, sf_d, vboxsf_io_prefetch);
+		if (err == 0)
+			err = vboxsf_dir_build_index(sf_d);
+	}
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	sf_i->lookup_fetching = 0;
+	if (err == -E2BIG)
+		sf_i->lookup_window = jiffies + VBOXSF_LOOKUP_DIR_BACKOFF;
+	if (err == 0 && sf_i->lookup_gen == f->gen) {
+		old = sf_i->lookup_dir;
+		sf_i->lookup_dir = sf_d;
+		sf_d = NULL;
+	}
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (old)
+		vboxsf_dir_info_put(old);
+	if (sf_d)
+		vboxsf_dir_info_free(sf_d);
+
+	dput(f->dentry);
+	kfree(f);
+}
+
+/* Must be called with lookup_fetching set, clears it on failure */
+static void vboxsf_lookup_dir_queue(struct inode *dir, struct dentry *dentry,
+				    unsigned long gen)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(dir);
+	struct vboxsf_lookup_fetch *f;
+
+	f = kmalloc(sizeof(*f), GFP_KERNEL);
+	if (!f) {
+		mutex_lock(&sf_i->handle_list_mutex);
+		sf_i->lookup_fetching = 0;
+		mutex_unlock(&sf_i->handle_list_mutex);
+		return;
+	}
+
+	INIT_WORK(&f->work, vboxsf_lookup_dir_work);
+	f->dentry = dget(dentry);
+	f->gen = gen;
+	queue_work(VBOXSF_SBI(dir->i_sb)->wq, &f->work);
+}
+
+/*
+ * Returns a reference to the listing of @dir for answering lookups, or NULL.
+ * If the directory has become busy the listing gets read in the background
+ * for later calls. With @fresh the listing must also be less than ttl old,
+ * so that its attributes may be used.
+ */
+static struct vboxsf_dir_info *vboxsf_lookup_dir_get(struct inode *dir,
+						     struct dentry *dentry,
+						     bool fresh)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(dir->i_sb);
+	struct vboxsf_inode *sf_i = VBOXSF_I(dir);
+	struct vboxsf_dir_info *sf_d, *stale = NULL;
+	unsigned long gen = 0;
+	bool expired, fetch = false;
+
+	/*
+	 * For lookups the listing is valid as long as the directory mtime is
+	 * unchanged, path walks do not restat the directory while it is in
+	 * use, so make sure its mtime is less than ttl old.
+	 */
+	if (!fresh && READ_ONCE(sf_i->lookup_dir) &&
+	    vboxsf_inode_revalidate(dentry))
+		return NULL;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	sf_d = sf_i->lookup_dir;
+	if (sf_d && (sf_i->force_restat ||
+		     time_before(sf_d->read_time, sbi->inval_time) ||
+		     !timespec64_equal(&sf_d->mtime, &dir->i_mtime))) {
+		stale = sf_d;
+		sf_i->lookup_dir = sf_d = NULL;
+		sf_i->lookup_gen++;
+	}
+	/* A too old listing is kept for lookups until a new one is read */
+	expired = sf_d && !time_before(jiffies, sf_d->read_time + sbi->o.ttl);
+	if (expired && fresh)
+		sf_d = NULL;
+	if (sf_d)
+		kref_get(&sf_d->refcount);
+	if ((!sf_d || expired) && !sf_i->lookup_fetching &&
+	    !sf_i->force_restat && vboxsf_dir_lookup_hot(sf_i)) {
+		sf_i->lookup_fetching = 1;
+		gen = sf_i->lookup_gen;
+		fetch = true;
+	}
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (stale)
+		vboxsf_dir_info_put(stale);
+
+	if (fetch)
+		vboxsf_lookup_dir_queue(dir, dentry, gen);
+
+	return sf_d;
+}
+
+/*
+ * Answer a lookup or negative dentry revalidation from the listing of a
+ * lookup-heavy @parent. Returns 0 or -ENOENT if the listing answered it,
+ * -EAGAIN if the host must be asked. On success *@attr_time is set to when
+ * the attributes were read.
+ */
+static int vboxsf_dir_lookup_listing(struct dentry *parent,
+				     struct dentry *dentry,
+				     struct shfl_fsobjinfo *fsinfo,
+				     unsigned long *attr_time)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(parent->d_sb);
+	struct vboxsf_dir_info *sf_d;
+	struct shfl_dirinfo *info;
+	int err;
+
+	/* The listing has UTF-8 names, dentry names are in the nls charset */
+	if (sbi->nls)
+		return -EAGAIN;
+
+	sf_d = vboxsf_lookup_dir_get(d_inode(parent), parent, false);
+	if (!sf_d)
+		return -EAGAIN;
+
+	info = vboxsf_dir_index_find(sbi, sf_d, &dentry->d_name);
+	if (IS_ERR(info)) {
+		err = PTR_ERR(info);
+	} else if (info) {
+		/*
+		 * The directory mtime only vouches for the entry existing,
+		 * writes to it do not change it. Its attributes are as old
+		 * as the listing, only use them within ttl, like a stat.
+		 */
+		if (time_before(jiffies, sf_d->read_time + sbi->o.ttl)) {
+			*fsinfo = info->info;
+			*attr_time = sf_d->read_time;
+			err = 0;
+		} else {
+			err = -EAGAIN;
+		}
+	} else {
+		err = -ENOENT;
+	}
+
+	if (err == 0 || err == -ENOENT)
+		vboxsf_stats_inc(sbi, listing_lookups);
+
+	vboxsf_dir_info_put(sf_d);
+	return err;
+}
+
+/*
+ * Revalidating the children of a directory one stat at a time costs a host
+ * round trip per file per ttl period, e.g. for git status or make in a big
+ * directory. When many children of a directory are being revalidated they
+ * get refreshed from one listing of it instead, so that revalidation
+ * traffic scales with directories rather than files.
+ *
+ * Returns 0 with the attributes of @dentry and the time they were read
+ * from the host, or -EAGAIN if the host must be asked.
+ */
+int vboxsf_dir_listing_stat(struct dentry *dentry,
+			    struct shfl_fsobjinfo *fsinfo,
+			    unsigned long *read_time)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
+	struct vboxsf_dir_info *sf_d;
+	struct name_snapshot name;
+	struct shfl_dirinfo *info;
+	struct dentry *parent;
+	int err = -EAGAIN;
+
+	/* The listing has UTF-8 names, dentry names are in the nls charset */
+	if (sbi->nls || IS_ROOT(dentry))
+		return -EAGAIN;
+
+	parent = dget_parent(dentry);
+	sf_d = vboxsf_lookup_dir_get(d_inode(parent), parent, true);
+	dput(parent);
+	if (!sf_d)
+		return -EAGAIN;
+
+	/* A missing entry may be an open, renamed file, let the host decide */
+	take_dentry_name_snapshot(&name, dentry);
+	info = vboxsf_dir_index_find(sbi, sf_d, &name.name);
+	if (!IS_ERR_OR_NULL(info)) {
+		*fsinfo = info->info;
+		*read_time = sf_d->read_time;
+		err = 0;
+	}
+	release_dentry_name_snapshot(&name);
+
+	vboxsf_dir_info_put(sf_d);
+	return err;
+}
+
 static struct dentry *vboxsf_dir_lookup(struct inode *parent,
 					struct dentry *dentry,
 					unsigned int flags)
 {
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(parent->i_sb);
+	unsigned long attr_time = jiffies;
 	struct shfl_fsobjinfo fsinfo;
 	struct inode *inode;
 	int err;
 
 	dentry->d_time = jiffies;
 
-	err = vboxsf_stat_dentry(dentry, &fsinfo);
+	err = vboxsf_dir_lookup_listing(dentry->d_parent, dentry, &fsinfo,
+					&attr_time);
+	if (err == -EAGAIN)
+		err = vboxsf_stat_dentry(dentry, &fsinfo);
 	if (err) {
 		inode = (err == -ENOENT) ? NULL : ERR_PTR(err);
 	} else {
 		inode = vboxsf_new_inode(parent->i_sb);
-		if (!IS_ERR(inode))
+		if (!IS_ERR(inode)) {
 			vboxsf_init_inode(sbi, inode, &fsinfo);
+			VBOXSF_I(inode)->attr_time = attr_time;
+		}
 	}
 
 	return d_splice_alias(inode, dentry);
@@ -249,6 +715,7 @@ static int vboxsf_dir_create(struct inode *parent, struct dentry *dentry,
 	struct vboxsf_inode *sf_parent_i = VBOXSF_I(parent);
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(parent->i_sb);
 	struct shfl_createparms params = {};
+	u32 client_idx;
 	int err;
 
 	params.handle = SHFL_HANDLE_NIL;
@@ -260,14 +727,14 @@ static int vboxsf_dir_create(struct inode *parent, struct dentry *dentry,
 				(is_dir ? SHFL_TYPE_DIRECTORY : SHFL_TYPE_FILE);
 	params.info.attr.additional = SHFLFSOBJATTRADD_NOTHING;
 
-	err = vboxsf_create_at_dentry(dentry, &params);
+	err = vboxsf_create_at_dentry(dentry, &params, &client_idx);
 	if (err)
 		return err;
 
 	if (params.result != SHFL_FILE_CREATED)
 		return -EPERM;
 
-	vboxsf_close(sbi->root, params.handle);
+	vboxsf_close(sbi->root, client_idx, params.handle);
 
 	err = vboxsf_dir_instantiate(parent, dentry, &params.info);
 	if (err)
@@ -275,6 +742,7 @@ static int vboxsf_dir_create(struct inode *parent, struct dentry *dentry,
 
 	/* parent directory access/change time changed */
 	sf_parent_i->force_restat = 1;
+	vboxsf_dir_cache_drop(parent);
 
 	return 0;
 }
@@ -312,6 +780,9 @@ static int vboxsf_dir_unlink(struct inode *parent, struct dentry *dentry)
 	if (IS_ERR(path))
 		return PTR_ERR(path);
 
+	/* Some hosts refuse to remove files which are still open */
+	vboxsf_close_inode_handles(inode);
+
 	err = vboxsf_remove(sbi->root, path, flags);
 	__putname(path);
 	if (err)
@@ -319,6 +790,7 @@ static int vboxsf_dir_unlink(struct inode *parent, struct dentry *dentry)
 
 	/* parent directory access/change time changed */
 	sf_parent_i->force_restat = 1;
+	vboxsf_dir_cache_drop(parent);
 
 	return 0;
 }
@@ -352,11 +824,26 @@ static int vboxsf_dir_rename(struct inode *old_parent,
 	if (d_inode(old_dentry)->i_mode & S_IFDIR)
 		shfl_flags = 0;
 
+	/*
+	 * Some hosts refuse to rename files which are still open. For a
+	 * directory that includes any file below it, so wait for all
+	 * deferred closes then.
+	 */
+	if (S_ISDIR(d_inode(old_dentry)->i_mode)) {
+		flush_work(&sbi->close_work);
+	} else {
+		vboxsf_close_inode_handles(d_inode(old_dentry));
+		if (d_really_is_positive(new_dentry))
+			vboxsf_close_inode_handles(d_inode(new_dentry));
+	}
+
 	err = vboxsf_rename(sbi->root, old_path, new_path, shfl_flags);
 	if (err == 0) {
 		/* parent directories access/change time changed */
 		sf_new_parent_i->force_restat = 1;
 		sf_old_parent_i->force_restat = 1;
+		vboxsf_dir_cache_drop(new_parent);
+		vboxsf_dir_cache_drop(old_parent);
 	}
 
 	__putname(new_path);
@@ -402,6 +889,7 @@ static int vboxsf_dir_symlink(struct inode *parent, struct dentry *dentry,
 
 	/* parent directory access/change time changed */
 	sf_parent_i->force_restat = 1;
+	vboxsf_dir_cache_drop(parent);
 	return 0;
 }
 
@@ -10,22 +10,35 @@
 #include <linux/pagemap.h>
 #include <linux/highmem.h>
 #include <linux/sizes.h>
+#include <linux/splice.h>
+#include <linux/vmalloc.h>
+#include <linux/wait_bit.h>
 #include "vfsmod.h"
 
-struct vboxsf_handle {
-	u64 handle;
-	u32 root;
-	u32 access_flags;
-	struct kref refcount;
-	struct list_head head;
-};
+/*
+ * With the denywrite mount option plain read-only opens ask the host to deny
+ * writes by others for as long as we keep the file open. If the host grants
+ * this, the file cannot change underneath us and attribute revalidation and
+ * page-cache checks are skipped while the handle lives. If the host refuses
+ * (e.g. someone has it open for writing), we retry without the deny mode.
+ *
+ * Note not all hosts enforce deny modes (POSIX hosts generally do not), so
+ * this is opt-in and only useful for hosts which do.
+ */
+static bool vboxsf_want_deny_write(struct inode *inode, struct file *file)
+{
+	return VBOXSF_SBI(inode->i_sb)->o.denywrite &&
+	       (file->f_flags & (O_ACCMODE | O_CREAT | O_TRUNC)) == O_RDONLY;
+}
 
 static int vboxsf_file_open(struct inode *inode, struct file *file)
 {
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
 	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
 	struct shfl_createparms params = {};
 	struct vboxsf_handle *sf_handle;
-	u32 access_flags = 0;
+	u32 access_flags = 0, client_idx;
+	bool deny_write;
 	int err;
 
 	sf_handle = kmalloc(sizeof(*sf_handle), GFP_KERNEL);
@@ -80,7 +93,32 @@ static int vboxsf_file_open(struct inode *inode, struct file *file)
 	params.create_flags |= access_flags;
 	params.info.attr.mode = inode->i_mode;
 
-	err = vboxsf_create_at_dentry(file_dentry(file), &params);
+	/*
+	 * Released deny-write handles stay open on the host until close_work
+	 * runs, close them first or the host refuses to open for writing.
+	 */
+	if (sbi->o.denywrite &&
+	    (file->f_flags & (O_ACCMODE | O_TRUNC)) != O_RDONLY)
+		flush_work(&sbi->close_work);
+
+	deny_write = vboxsf_want_deny_write(inode, file);
+	if (deny_write) {
+		params.create_flags |= SHFL_CF_ACCESS_DENYWRITE;
+		err = vboxsf_create_at_dentry(file_dentry(file), &params,
+					      &client_idx);
+		if (err == 0 && params.handle != SHFL_HANDLE_NIL)
+			goto opened;
+
+		/* refused (or failed), fall back to a normal open */
+		deny_write = false;
+		memset(&params, 0, sizeof(params));
+		params.handle = SHFL_HANDLE_NIL;
+		params.create_flags = SHFL_CF_ACT_FAIL_IF_NEW | access_flags;
+		params.info.attr.mode = inode->i_mode;
+	}
+
+	err = vboxsf_create_at_dentry(file_dentry(file), &params,
+				      &client_idx);
 	if (err == 0 && params.handle == SHFL_HANDLE_NIL)
 		err = (params.result == SHFL_FILE_EXISTS) ? -EEXIST : -ENOENT;
 	if (err) {
@@ -88,119 +126,1319 @@ static int vboxsf_file_open(struct inode *inode, struct file *file)
 		return err;
 	}
 
-	/* the host may have given us different attr then requested */
-	sf_i->force_restat = 1;
+opened:
+	/* the host may have given us different attr then requested */
+	sf_i->force_restat = 1;
+
+	/* init our handle struct and add it to the inode's handles list */
+	sf_handle->handle = params.handle;
+	sf_handle->root = sbi->root;
+	sf_handle->client_idx = client_idx;
+	sf_handle->access_flags = access_flags;
+	sf_handle->deny_write = deny_write;
+	kref_init(&sf_handle->refcount);
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	list_add(&sf_handle->head, &sf_i->handle_list);
+	if (deny_write)
+		sf_i->deny_write_count++;
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	file->private_data = sf_handle;
+	vboxsf_fscache_open(inode, file);
+
+	/* Page-cache hits never block, see vboxsf_file_read_iter() */
+	file->f_mode |= FMODE_NOWAIT;
+	return 0;
+}
+
+static void vboxsf_handle_release(struct kref *refcount)
+{
+	struct vboxsf_handle *sf_handle =
+		container_of(refcount, struct vboxsf_handle, refcount);
+
+	vboxsf_close(sf_handle->root, sf_handle->client_idx, sf_handle->handle);
+	kfree(sf_handle);
+}
+
+void vboxsf_put_handle(struct vboxsf_handle *sf_handle)
+{
+	kref_put(&sf_handle->refcount, vboxsf_handle_release);
+}
+
+/*
+ * Get a reference to any open handle for the inode, this is used to do
+ * handle based stat calls, which keep working after the file has been
+ * renamed or unlinked. Returns NULL if the inode has no open handles.
+ */
+struct vboxsf_handle *vboxsf_get_handle(struct vboxsf_inode *sf_i)
+{
+	struct vboxsf_handle *sf_handle = NULL;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	if (!list_empty(&sf_i->handle_list)) {
+		sf_handle = list_first_entry(&sf_i->handle_list,
+					     struct vboxsf_handle, head);
+		kref_get(&sf_handle->refcount);
+	}
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	return sf_handle;
+}
+
+/* Like vboxsf_get_handle, but only returns handles opened for reading */
+struct vboxsf_handle *vboxsf_get_read_handle(struct vboxsf_inode *sf_i)
+{
+	struct vboxsf_handle *h, *sf_handle = NULL;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	list_for_each_entry(h, &sf_i->handle_list, head) {
+		if (h->access_flags & SHFL_CF_ACCESS_READ) {
+			kref_get(&h->refcount);
+			sf_handle = h;
+			break;
+		}
+	}
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	return sf_handle;
+}
+
+static void vboxsf_remove_handle(struct vboxsf_inode *sf_i,
+				 struct vboxsf_handle *sf_handle)
+{
+	mutex_lock(&sf_i->handle_list_mutex);
+	list_del(&sf_handle->head);
+	if (sf_handle->deny_write)
+		sf_i->deny_write_count--;
+	mutex_unlock(&sf_i->handle_list_mutex);
+}
+
+/*
+ * Do a close deferred by vboxsf_file_release. Dirty files are written back
+ * and their writes are recorded first, see vboxsf_record_own_write(). Their
+ * handle stays on the inode's handle_list until then so that writepage can
+ * use it.
+ */
+static void vboxsf_close_deferred(struct vboxsf_sbi *sbi,
+				  struct vboxsf_handle *sf_handle)
+{
+	struct inode *inode = sf_handle->close_inode;
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+
+	if (sf_handle->close_wb) {
+		filemap_write_and_wait(inode->i_mapping);
+		vboxsf_record_own_write(inode, sf_handle);
+		vboxsf_remove_handle(sf_i, sf_handle);
+	}
+
+	vboxsf_put_handle(sf_handle);
+
+	spin_lock(&sbi->close_lock);
+	sf_i->close_count--;
+	spin_unlock(&sbi->close_lock);
+	wake_up_var(&sf_i->close_count);
+
+	iput(inode);
+}
+
+/*
+ * Queued handles are taken off close_list one at a time, so that
+ * vboxsf_close_inode_handles() can still find all but the one being closed.
+ */
+void vboxsf_close_work(struct work_struct *work)
+{
+	struct vboxsf_sbi *sbi = container_of(work, struct vboxsf_sbi,
+					      close_work);
+	struct vboxsf_handle *sf_handle;
+
+	for (;;) {
+		spin_lock(&sbi->close_lock);
+		sf_handle = list_first_entry_or_null(&sbi->close_list,
+						     struct vboxsf_handle,
+						     close_head);
+		if (sf_handle)
+			list_del(&sf_handle->close_head);
+		spin_unlock(&sbi->close_lock);
+
+		if (!sf_handle)
+			break;
+
+		vboxsf_close_deferred(sbi, sf_handle);
+	}
+}
+
+/*
+ * Some hosts refuse to remove or rename files which are still open. Close
+ * the released handles of @inode now, rather than waiting for close_work to
+ * get to them after writing back other, unrelated files.
+ */
+void vboxsf_close_inode_handles(struct inode *inode)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_handle *sf_handle, *tmp;
+	LIST_HEAD(list);
+
+	spin_lock(&sbi->close_lock);
+	list_for_each_entry_safe(sf_handle, tmp, &sbi->close_list, close_head) {
+		if (sf_handle->close_inode == inode)
+			list_move_tail(&sf_handle->close_head, &list);
+	}
+	spin_unlock(&sbi->close_lock);
+
+	list_for_each_entry_safe(sf_handle, tmp, &list, close_head) {
+		list_del(&sf_handle->close_head);
+		vboxsf_close_deferred(sbi, sf_handle);
+	}
+
+	/* close_work may be busy closing one of them */
+	wait_var_event(&sf_i->close_count, !READ_ONCE(sf_i->close_count));
+}
+
+static int vboxsf_file_release(struct inode *inode, struct file *file)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_handle *sf_handle = file->private_data;
+
+	/*
+	 * When a file is closed on our (the guest) side, we want any subsequent
+	 * accesses done on the host side to see all changes done from our side.
+	 * With the strictclose mount option this is done before close()
+	 * returns. Otherwise the write back and the host side close are done
+	 * asynchronously from close_work, so that close() does not need to
+	 * wait for any host round trips.
+	 */
+	if (sbi->o.strictclose) {
+		filemap_write_and_wait(inode->i_mapping);
+		vboxsf_record_own_write(inode, sf_handle);
+		vboxsf_remove_handle(sf_i, sf_handle);
+		vboxsf_put_handle(sf_handle);
+		return 0;
+	}
+
+	if (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY) ||
+	    mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK) ||
+	    READ_ONCE(sf_i->own_write_pending)) {
+		sf_handle->close_wb = true;
+	} else {
+		vboxsf_remove_handle(sf_i, sf_handle);
+		sf_handle->close_wb = false;
+	}
+
+	ihold(inode);
+	sf_handle->close_inode = inode;
+
+	spin_lock(&sbi->close_lock);
+	list_add_tail(&sf_handle->close_head, &sbi->close_list);
+	sf_i->close_count++;
+	spin_unlock(&sbi->close_lock);
+
+	queue_work(sbi->wq, &sbi->close_work);
+	return 0;
+}
+
+/*
+ * Large reads and writes are split into stripes of o.stripe_size bytes, up
+ * to o.stripes of which are sent to the host concurrently on the same
+ * handle, so that single stream throughput is not bound by the latency of
+ * a host round-trip. The first stripe of each round is done by the caller,
+ * the others from the per-mount stripe workqueue. Only the data up to the
+ * first short or failed stripe counts as transferred.
+ */
+struct vboxsf_stripe {
+	struct work_struct work;
+	struct completion done;
+	struct vboxsf_handle *sf_handle;
+	enum vboxsf_io_class class;
+	bool write;
+	u64 offset;
+	u32 len;
+	u32 transferred;
+	int err;
+	u8 *buf;
+};
+
+static void vboxsf_stripe_io(struct vboxsf_stripe *st)
+{
+	u32 n = st->len;
+
+	if (st->write)
+		st->err = vboxsf_write(st->sf_handle->root,
+				       st->sf_handle->client_idx,
+				       st->sf_handle->handle, st->offset,
+				       &n, st->buf, st->class);
+	else
+		st->err = vboxsf_read(st->sf_handle->root,
+				      st->sf_handle->client_idx,
+				      st->sf_handle->handle, st->offset,
+				      &n, st->buf, st->class);
+
+	st->transferred = st->err ? 0 : n;
+}
+
+static void vboxsf_stripe_work(struct work_struct *work)
+{
+	struct vboxsf_stripe *st = container_of(work, struct vboxsf_stripe,
+						work);
+
+	vboxsf_stripe_io(st);
+	complete(&st->done);
+}
+
+/* Like vboxsf_read() / vboxsf_write(), but striped */
+static int vboxsf_striped_io(struct inode *inode,
+			     struct vboxsf_handle *sf_handle, bool write,
+			     u64 offset, u32 *buf_len, u8 *buf,
+			     enum vboxsf_io_class class)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	u32 stripe_size = sbi->o.stripe_size;
+	u32 len = *buf_len, done = 0, pos;
+	unsigned int i, n, width;
+	struct vboxsf_stripe *st;
+	bool stop = false;
+	int err = 0;
+
+	width = min_t(u32, sbi->o.stripes, DIV_ROUND_UP(len, stripe_size));
+	st = width > 1 ? kmalloc_array(width, sizeof(*st), GFP_NOFS) : NULL;
+	if (!st) {
+		if (write)
+			return vboxsf_write(sf_handle->root,
+					    sf_handle->client_idx,
+					    sf_handle->handle,
+					    offset, buf_len, buf, class);
+		return vboxsf_read(sf_handle->root, sf_handle->client_idx,
+				   sf_handle->handle, offset, buf_len, buf,
+				   class);
+	}
+
+	while (done < len && !stop) {
+		for (n = 0, pos = done; n < width && pos < len; n++) {
+			st[n].sf_handle = sf_handle;
+			st[n].class = class;
+			st[n].write = write;
+			st[n].offset = offset + pos;
+			st[n].buf = buf + pos;
+			st[n].len = min(stripe_size, len - pos);
+			pos += st[n].len;
+
+			if (n == 0)
+				continue;
+
+			INIT_WORK(&st[n].work, vboxsf_stripe_work);
+			init_completion(&st[n].done);
+			queue_work(sbi->stripe_wq, &st[n].work);
+		}
+
+		vboxsf_stripe_io(&st[0]);
+		for (i = 1; i < n; i++)
+			wait_for_completion(&st[i].done);
+
+		for (i = 0; i < n && !stop; i++) {
+			done += st[i].transferred;
+			if (st[i].err)
+				err = st[i].err;
+			stop = st[i].err || st[i].transferred < st[i].len;
+		}
+	}
+
+	kfree(st);
+	*buf_len = done;
+	return err;
+}
+
+/*
+ * Read a run of consecutive, locked page-cache pages with a single host
+ * call, by mapping them into one virtually contiguous buffer.
+ */
+static void vboxsf_read_pages(struct vboxsf_handle *sf_handle,
+			      struct inode *inode, struct page **pages,
+			      unsigned int nr_pages)
+{
+	u32 nread = nr_pages * PAGE_SIZE;
+	unsigned int i;
+	int err;
+	u8 *buf;
+
+	buf = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!buf) {
+		err = -ENOMEM;
+	} else {
+		err = vboxsf_striped_io(inode, sf_handle, false,
+					page_offset(pages[0]), &nread, buf,
+					vboxsf_io_readahead);
+		if (err == 0)
+			memset(buf + nread, 0, nr_pages * PAGE_SIZE - nread);
+		vunmap(buf);
+	}
+
+	for (i = 0; i < nr_pages; i++) {
+		if (err == 0) {
+			flush_dcache_page(pages[i]);
+			SetPageUptodate(pages[i]);
+			vboxsf_fscache_write_page(inode, pages[i]);
+		} else {
+			SetPageError(pages[i]);
+		}
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+}
+
+/*
+ * Readahead: add the pages to the page-cache and read each run of
+ * consecutive pages (up to VBOXSF_MAX_IO_PAGES) with one host call,
+ * rather then doing a host round trip per page through readpage.
+ */
+static int vboxsf_readpages(struct file *file, struct address_space *mapping,
+			    struct list_head *pages, unsigned int nr_pages)
+{
+	struct vboxsf_handle *sf_handle = file->private_data;
+	struct inode *inode = mapping->host;
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct page **run, *page;
+	unsigned int nr_run = 0;
+
+	run = kmalloc_array(min_t(unsigned int, nr_pages, VBOXSF_MAX_IO_PAGES),
+			    sizeof(*run), GFP_KERNEL);
+	if (!run)
+		return -ENOMEM;
+
+	vboxsf_stats_inc(sbi, readahead_windows);
+	vboxsf_stats_add(sbi, readahead_pages, nr_pages);
+
+	/* The list is in reverse order, the lowest index is at the tail */
+	while (!list_empty(pages)) {
+		page = lru_to_page(pages);
+		list_del(&page->lru);
+
+		if (add_to_page_cache_lru(page, mapping, page->index,
+				readahead_gfp_mask(mapping))) {
+			put_page(page);
+			continue;
+		}
+
+		/* 0 means the page is being read from the local cache */
+		if (vboxsf_fscache_readpage(inode, page) == 0) {
+			put_page(page);
+			continue;
+		}
+
+		if (nr_run && (nr_run == VBOXSF_MAX_IO_PAGES ||
+			       run[nr_run - 1]->index + 1 != page->index)) {
+			vboxsf_read_pages(sf_handle, inode, run, nr_run);
+			nr_run = 0;
+		}
+		run[nr_run++] = page;
+	}
+
+	if (nr_run)
+		vboxsf_read_pages(sf_handle, inode, run, nr_run);
+
+	kfree(run);
+	return 0;
+}
+
+static struct vboxsf_handle *vboxsf_get_write_handle(struct vboxsf_inode *sf_i)
+{
+	struct vboxsf_handle *h, *sf_handle = NULL;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	list_for_each_entry(h, &sf_i->handle_list, head) {
+		if (h->access_flags == SHFL_CF_ACCESS_WRITE ||
+		    h->access_flags == SHFL_CF_ACCESS_READWRITE) {
+			kref_get(&h->refcount);
+			sf_handle = h;
+			break;
+		}
+	}
+	/* All write handles closed, use the one pinned by shared mappings */
+	if (!sf_handle && sf_i->mmap_handle) {
+		kref_get(&sf_i->mmap_handle->refcount);
+		sf_handle = sf_i->mmap_handle;
+	}
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	return sf_handle;
+}
+
+/*
+ * Shared writable mappings pin a write handle in sf_i->mmap_handle, so that
+ * dirty pages can still be written back after the file has been closed.
+ * When the last such mapping goes away, the dirty pages are written back
+ * and the handle is unpinned from the per-mount workqueue, rather then
+ * stalling munmap() until all pages have been written.
+ */
+static bool vboxsf_vma_is_shared_writable(struct vm_area_struct *vma)
+{
+	return (vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) ==
+	       (VM_SHARED | VM_MAYWRITE);
+}
+
+void vboxsf_mmap_work(struct work_struct *work)
+{
+	struct vboxsf_inode *sf_i = container_of(work, struct vboxsf_inode,
+						 mmap_work);
+	struct inode *inode = &sf_i->vfs_inode;
+	struct vboxsf_handle *sf_handle = NULL;
+
+	filemap_write_and_wait(inode->i_mapping);
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	if (sf_i->mmap_count == 0) {
+		sf_handle = sf_i->mmap_handle;
+		sf_i->mmap_handle = NULL;
+	}
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (sf_handle)
+		vboxsf_put_handle(sf_handle);
+
+	iput(inode);
+}
+
+static void vboxsf_vma_open(struct vm_area_struct *vma)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(file_inode(vma->vm_file));
+
+	if (!vboxsf_vma_is_shared_writable(vma))
+		return;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	sf_i->mmap_count++;
+	mutex_unlock(&sf_i->handle_list_mutex);
+}
+
+static void vboxsf_vma_close(struct vm_area_struct *vma)
+{
+	struct inode *inode = file_inode(vma->vm_file);
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	bool last;
+
+	if (!vboxsf_vma_is_shared_writable(vma))
+		return;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	last = --sf_i->mmap_count == 0;
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (!last)
+		return;
+
+	ihold(inode);
+	if (!queue_work(sbi->wq, &sf_i->mmap_work))
+		iput(inode);
+}
+
+static vm_fault_t vboxsf_page_mkwrite(struct vm_fault *vmf)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(file_inode(vmf->vma->vm_file));
+
+	/* Without a write handle the page could never be written back */
+	if (!READ_ONCE(sf_i->mmap_handle))
+		return VM_FAULT_SIGBUS;
+
+	return filemap_page_mkwrite(vmf);
+}
+
+static const struct vm_operations_struct vboxsf_file_vm_ops = {
+	.open		= vboxsf_vma_open,
+	.close		= vboxsf_vma_close,
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= vboxsf_page_mkwrite,
+};
+
+static int vboxsf_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(file_inode(file));
+	struct vboxsf_handle *sf_handle;
+	int err;
+
+	err = generic_file_mmap(file, vma);
+	if (err)
+		return err;
+
+	vma->vm_ops = &vboxsf_file_vm_ops;
+	if (!vboxsf_vma_is_shared_writable(vma))
+		return 0;
+
+	sf_handle = vboxsf_get_write_handle(sf_i);
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	sf_i->mmap_count++;
+	if (!sf_i->mmap_handle) {
+		sf_i->mmap_handle = sf_handle;
+		sf_handle = NULL;
+	}
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	/* Already pinned (or the fallback returned the pinned handle) */
+	if (sf_handle)
+		vboxsf_put_handle(sf_handle);
+
+	return 0;
+}
+
+/*
+ * Ask the host to flush the file to stable storage. Concurrent callers are
+ * coalesced: a flush started after our data was written back covers us, so
+ * if another caller started (and, since we hold flush_mutex, finished) one
+ * while we were waiting for the mutex, we use its result instead of issuing
+ * another SHFL_FN_FLUSH.
+ */
+static int vboxsf_flush_handle(struct vboxsf_inode *sf_i,
+			       struct vboxsf_handle *sf_handle)
+{
+	unsigned long gen = READ_ONCE(sf_i->flush_gen);
+	int err;
+
+	mutex_lock(&sf_i->flush_mutex);
+
+	if (sf_i->flush_gen != gen) {
+		err = sf_i->flush_err;
+	} else {
+		WRITE_ONCE(sf_i->flush_gen, gen + 1);
+		sf_i->needs_flush = 0;
+		err = vboxsf_flush(sf_handle->root, sf_handle->client_idx,
+				   sf_handle->handle);
+		sf_i->flush_err = err;
+	}
+
+	mutex_unlock(&sf_i->flush_mutex);
+	return err;
+}
+
+static int vboxsf_file_fsync(struct file *file, loff_t start, loff_t end,
+			     int datasync)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(file_inode(file));
+	int err;
+
+	err = file_write_and_wait_range(file, start, end);
+	if (err)
+		return err;
+
+	vboxsf_record_own_write(file_inode(file), file->private_data);
+	return vboxsf_flush_handle(sf_i, file->private_data);
+}
+
+/*
+ * Asynchronous (aio / io_uring) kiocbs which cannot be served from the
+ * page-cache are not read into it, instead the user's pages are pinned and
+ * the host read or write is done on them from the per-mount workqueue.
+ * read_iter / write_iter then return -EIOCBQUEUED and the iocb is completed
+ * from the workqueue once the host is done. HGCM calls themselves always
+ * block, so this is as asynchronous as it gets for the submitter.
+ *
+ * Only overwrites within the current file size are done asynchronously,
+ * writes which extend the file go through the page-cache as before.
+ */
+struct vboxsf_aio_seg {
+	struct page **pages;
+	size_t start;
+	size_t len;
+};
+
+struct vboxsf_aio {
+	struct work_struct work;
+	struct kiocb *iocb;
+	bool write;
+	bool dirty;	/* Pinned user pages which we read into */
+	unsigned int nr_segs;
+	struct vboxsf_aio_seg segs[];
+};
+
+static bool vboxsf_aio_possible(struct kiocb *iocb, struct iov_iter *iter)
+{
+	size_t count = iov_iter_count(iter);
+
+	if (is_sync_kiocb(iocb) || !count || count > SHFL_MAX_RW_COUNT)
+		return false;
+
+	if (!iter_is_iovec(iter) && !iov_iter_is_bvec(iter))
+		return false;
+
+	return !filemap_range_has_page(iocb->ki_filp->f_mapping, iocb->ki_pos,
+				       iocb->ki_pos + count - 1);
+}
+
+static void vboxsf_aio_free(struct vboxsf_aio *aio)
+{
+	struct vboxsf_aio_seg *seg;
+	unsigned int i, j, nr_pages;
+
+	for (i = 0; i < aio->nr_segs; i++) {
+		seg = &aio->segs[i];
+		nr_pages = DIV_ROUND_UP(seg->start + seg->len, PAGE_SIZE);
+		for (j = 0; j < nr_pages; j++) {
+			if (aio->dirty)
+				set_page_dirty_lock(seg->pages[j]);
+			put_page(seg->pages[j]);
+		}
+		kvfree(seg->pages);
+	}
+
+	kfree(aio);
+}
+
+static void vboxsf_aio_work(struct work_struct *work)
+{
+	struct vboxsf_aio *aio = container_of(work, struct vboxsf_aio, work);
+	struct kiocb *iocb = aio->iocb;
+	struct vboxsf_handle *sf_handle = iocb->ki_filp->private_data;
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct vboxsf_aio_seg *seg;
+	loff_t pos = iocb->ki_pos;
+	unsigned int i;
+	ssize_t done = 0;
+	int err = 0;
+	u32 n;
+	u8 *buf;
+
+	for (i = 0; i < aio->nr_segs; i++) {
+		seg = &aio->segs[i];
+		buf = vmap(seg->pages, DIV_ROUND_UP(seg->start + seg->len,
+						    PAGE_SIZE),
+			   VM_MAP, PAGE_KERNEL);
+		if (!buf) {
+			err = -ENOMEM;
+			break;
+		}
+
+		n = seg->len;
+		err = vboxsf_striped_io(inode, sf_handle, aio->write,
+					pos + done, &n, buf + seg->start,
+					vboxsf_io_sync_data);
+		vunmap(buf);
+		if (err)
+			break;
+
+		done += n;
+		if (n < seg->len)
+			break; /* EOF */
+	}
+
+	if (aio->write) {
+		if (done) {
+			/* Drop any pages read in while the write was running */
+			invalidate_inode_pages2_range(inode->i_mapping,
+					pos >> PAGE_SHIFT,
+					(pos + done - 1) >> PAGE_SHIFT);
+			vboxsf_note_own_write(inode);
+		}
+		inode_dio_end(inode);
+	}
+
+	vboxsf_aio_free(aio);
+
+	if (done)
+		iocb->ki_pos += done;
+	iocb->ki_complete(iocb, done ? done : err, 0);
+}
+
+/* Pin the pages of iter and queue the host call */
+static ssize_t vboxsf_aio_submit(struct kiocb *iocb, struct iov_iter *iter,
+				 bool write)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(file_inode(iocb->ki_filp)->i_sb);
+	size_t pinned = 0;
+	struct vboxsf_aio_seg *seg;
+	struct vboxsf_aio *aio;
+	int max_segs;
+	ssize_t n;
+
+	/* Every segment holds at least one page */
+	max_segs = iov_iter_npages(iter, INT_MAX);
+	aio = kzalloc(struct_size(aio, segs, max_segs), GFP_KERNEL);
+	if (!aio)
+		return -ENOMEM;
+
+	INIT_WORK(&aio->work, vboxsf_aio_work);
+	aio->iocb = iocb;
+	aio->write = write;
+	aio->dirty = !write && iter_is_iovec(iter);
+
+	while (iov_iter_count(iter) && aio->nr_segs < max_segs) {
+		seg = &aio->segs[aio->nr_segs];
+		n = iov_iter_get_pages_alloc(iter, &seg->pages,
+					     VBOXSF_MAX_IO_PAGES * PAGE_SIZE,
+					     &seg->start);
+		if (n <= 0) {
+			iov_iter_revert(iter, pinned);
+			aio->dirty = false;
+			vboxsf_aio_free(aio);
+			return n ? n : -EFAULT;
+		}
+
+		seg->len = n;
+		aio->nr_segs++;
+		iov_iter_advance(iter, n);
+		pinned += n;
+	}
+
+	if (write)
+		inode_dio_begin(file_inode(iocb->ki_filp));
+
+	queue_work(sbi->wq, &aio->work);
+	return -EIOCBQUEUED;
+}
+
+/*
+ * Note that since we are accessing files on the host's filesystem, files
+ * may always be changed underneath us by the host!
+ *
+ * The vboxsf API between the guest and the host does not offer any functions
+ * to deal with this. There is no inode-generation to check for changes, no
+ * events / callback on changes and no way to lock files.
+ *
+ * To avoid returning stale data when a file gets *opened* on our (the guest)
+ * side, we do a "stat" on the host side, then compare the mtime with the
+ * last known mtime and invalidate the page-cache if they differ.
+ * This is done from vboxsf_inode_revalidate().
+ *
+ * Once a file is open, vboxsf_inode_revalidate() stats it through one of
+ * the inode's open handles (SHFL_INFO_GET | SHFL_INFO_FILE) rather than by
+ * path, so fstat() and revalidation keep working after the file has been
+ * renamed or unlinked on either side.
+ *
+ * When reads are done through the read_iter fop, it is possible to do
+ * further cache revalidation then, the cache= mount option selects one of:
+ *
+ * open)   Rely solely on the revalidation done at open time (default)
+ * strict) Do another "stat" on the handle and compare mtime again, on stat
+ *         failure invalidate the cache
+ * none)   Simply always call invalidate_inode_pages2_range on the range of
+ *         the read, so that all reads go to the host
+ * loose)  Trust the page-cache, never invalidate it because of a changed
+ *         mtime, not even at open time
+ *
+ * With the default "open" mode only data written on the host side before
+ * open() on the guest side is guaranteed to be seen by the guest.
+ */
+static ssize_t vboxsf_file_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct address_space *mapping = inode->i_mapping;
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	size_t count = iov_iter_count(iter);
+	loff_t pos = iocb->ki_pos;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	int err;
+
+	/* the host guarantees nobody else is writing to the file */
+	if (READ_ONCE(VBOXSF_I(inode)->deny_write_count))
+		goto read;
+
+	switch (sbi->o.cache) {
+	case vboxsf_cache_strict:
+		if (nowait)
+			return -EAGAIN;
+
+		VBOXSF_I(inode)->force_restat = 1;
+		if (vboxsf_inode_revalidate(file_dentry(file)))
+			invalidate_inode_pages2(mapping);
+		break;
+	case vboxsf_cache_none:
+		if (count == 0 ||
+		    !filemap_range_has_page(mapping, pos, pos + count - 1))
+			break;
+
+		if (nowait)
+			return -EAGAIN;
+
+		/* Write back any mmap dirtied pages before dropping them */
+		err = filemap_write_and_wait_range(mapping, pos,
+						   pos + count - 1);
+		if (err)
+			return err;
+
+		invalidate_inode_pages2_range(mapping, pos >> PAGE_SHIFT,
+					      (pos + count - 1) >> PAGE_SHIFT);
+		break;
+	default:
+		break;
+	}
+
+read:
+	if (pos < i_size_read(inode) && vboxsf_aio_possible(iocb, iter)) {
+		/* Pinning the user pages may fault, retry from a worker */
+		if (nowait)
+			return -EAGAIN;
+		return vboxsf_aio_submit(iocb, iter, false);
+	}
+
+	/* With IOCB_NOWAIT this only succeeds on page-cache hits */
+	return generic_file_read_iter(iocb, iter);
+}
+
+static ssize_t vboxsf_file_write_iter(struct kiocb *iocb,
+				      struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	size_t count = iov_iter_count(from);
+	ssize_t ret;
+
+	if (is_sync_kiocb(iocb))
+		return generic_file_write_iter(iocb, from);
+
+	/*
+	 * Buffered writes always block and so may pinning the user pages for
+	 * an async write, let the caller retry from a worker.
+	 */
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	inode_lock(inode);
+
+	if ((iocb->ki_flags & IOCB_APPEND) ||
+	    iocb->ki_pos + count > i_size_read(inode) ||
+	    !vboxsf_aio_possible(iocb, from)) {
+		inode_unlock(inode);
+		return generic_file_write_iter(iocb, from);
+	}
+
+	ret = file_remove_privs(iocb->ki_filp);
+	if (ret == 0)
+		ret = file_update_time(iocb->ki_filp);
+	if (ret == 0)
+		ret = vboxsf_aio_submit(iocb, from, true);
+
+	inode_unlock(inode);
+	return ret;
+}
+
+/*
+ * splice_read / sendfile: if nothing of the file is in the page-cache, read
+ * from the host straight into pages owned by the pipe, with up to
+ * VBOXSF_MAX_IO_PAGES per host call, instead of first populating the
+ * page-cache and then copying from it. This also keeps one-shot streaming
+ * (e.g. serving files) from polluting the page-cache. If the file is cached
+ * (and may have data which is not on the host yet), use the page-cache.
+ */
+static ssize_t vboxsf_file_splice_read(struct file *in, loff_t *ppos,
+				       struct pipe_inode_info *pipe,
+				       size_t len, unsigned int flags)
+{
+	struct vboxsf_handle *sf_handle = in->private_data;
+	struct inode *inode = file_inode(in);
+	loff_t size = i_size_read(inode);
+	struct page **pages;
+	struct iov_iter to;
+	ssize_t n, total = 0;
+	unsigned int i, nr_pages;
+	size_t start;
+	u32 nread;
+	int err = 0;
+	u8 *buf;
+
+	if (inode->i_mapping->nrpages)
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
+
+	if (*ppos >= size)
+		return 0;
+	len = min_t(loff_t, len, size - *ppos);
+
+	iov_iter_pipe(&to, READ, pipe, len);
+
+	while (iov_iter_count(&to)) {
+		n = iov_iter_get_pages_alloc(&to, &pages,
+					     VBOXSF_MAX_IO_PAGES * PAGE_SIZE,
+					     &start);
+		if (n <= 0) {
+			err = n;
+			break;
+		}
+
+		nr_pages = DIV_ROUND_UP(start + n, PAGE_SIZE);
+		buf = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+		if (buf) {
+			nread = n;
+			err = vboxsf_striped_io(inode, sf_handle, false,
+						*ppos + total, &nread,
+						buf + start,
+						vboxsf_io_sync_data);
+			vunmap(buf);
+		} else {
+			err = -ENOMEM;
+		}
+
+		for (i = 0; i < nr_pages; i++)
+			put_page(pages[i]);
+		kvfree(pages);
+
+		/* This also frees the pipe buffers we did not fill */
+		iov_iter_advance(&to, err ? 0 : nread);
+		if (err)
+			break;
+
+		total += nread;
+		if (nread < n)
+			break; /* EOF */
+	}
+
+	if (total) {
+		*ppos += total;
+		file_accessed(in);
+		return total;
+	}
+
+	return err;
+}
+
+/*
+ * splice_write and copy_file_range bypass the page-cache and send the data
+ * to the host in chunks of up to SHFL_MAX_RW_COUNT bytes, rather then one
+ * page at a time through write_end. Two buffers are used: while the host
+ * writes one of them from the per-mount workqueue, the caller fills the
+ * other one from the pipe or the source file.
+ */
+struct vboxsf_bulk_buf {
+	struct work_struct work;
+	struct completion done;
+	struct inode *inode;
+	struct vboxsf_handle *sf_handle;
+	loff_t pos;
+	u32 len;
+	int err;
+	u8 *buf;
+};
+
+struct vboxsf_bulk_write {
+	struct vboxsf_bulk_buf bufs[2];
+	struct vboxsf_bulk_buf *fill;	/* Being filled by the caller */
+	struct vboxsf_bulk_buf *busy;	/* Being written to the host, or NULL */
+	struct file *file;
+	loff_t start;
+	loff_t pos;
+	size_t written;
+	u32 size;
+	int err;
+};
+
+static void vboxsf_bulk_work(struct work_struct *work)
+{
+	struct vboxsf_bulk_buf *b =
+		container_of(work, struct vboxsf_bulk_buf, work);
+	u32 nwritten = b->len;
+
+	b->err = vboxsf_striped_io(b->inode, b->sf_handle, true, b->pos,
+				   &nwritten, b->buf, vboxsf_io_sync_data);
+	if (b->err == 0 && nwritten != b->len)
+		b->err = -EIO;
+	b->len = b->err ? 0 : nwritten;
+
+	complete(&b->done);
+}
+
+static void vboxsf_bulk_wait(struct vboxsf_bulk_write *bulk)
+{
+	struct vboxsf_bulk_buf *b = bulk->busy;
+
+	if (!b)
+		return;
+
+	wait_for_completion(&b->done);
+	bulk->busy = NULL;
+
+	bulk->written += b->len;
+	if (!bulk->err)
+		bulk->err = b->err;
+}
+
+/* Hand the fill buffer to the host and switch to the other buffer */
+static int vboxsf_bulk_submit(struct vboxsf_bulk_write *bulk)
+{
+	struct vboxsf_bulk_buf *b = bulk->fill;
+
+	vboxsf_bulk_wait(bulk);
+	if (bulk->err)
+		return bulk->err;
+
+	if (!b->len)
+		return 0;
+
+	b->pos = bulk->pos;
+	bulk->pos += b->len;
+	reinit_completion(&b->done);
+	queue_work(VBOXSF_SBI(file_inode(bulk->file)->i_sb)->wq, &b->work);
+	bulk->busy = b;
+
+	bulk->fill = (b == &bulk->bufs[0]) ? &bulk->bufs[1] : &bulk->bufs[0];
+	bulk->fill->len = 0;
+	return 0;
+}
+
+static void vboxsf_bulk_free(struct vboxsf_bulk_write *bulk)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		kvfree(bulk->bufs[i].buf);
+		destroy_work_on_stack(&bulk->bufs[i].work);
+	}
+}
+
+/*
+ * Must be called with the inode of file locked. Writes back any cached dirty
+ * pages in the range first, so that they cannot overwrite our data later.
+ */
+static int vboxsf_bulk_init(struct vboxsf_bulk_write *bulk, struct file *file,
+			    loff_t pos, size_t count)
+{
+	int i, err;
+
+	memset(bulk, 0, sizeof(*bulk));
+	bulk->file = file;
+	bulk->start = pos;
+	bulk->pos = pos;
+	bulk->size = min_t(size_t, PAGE_ALIGN(count), SHFL_MAX_RW_COUNT);
+	bulk->fill = &bulk->bufs[0];
+
+	for (i = 0; i < 2; i++) {
+		INIT_WORK_ONSTACK(&bulk->bufs[i].work, vboxsf_bulk_work);
+		init_completion(&bulk->bufs[i].done);
+		bulk->bufs[i].inode = file_inode(file);
+		bulk->bufs[i].sf_handle = file->private_data;
+	}
+
+	err = file_remove_privs(file);
+	if (err)
+		goto fail;
 
-	/* init our handle struct and add it to the inode's handles list */
-	sf_handle->handle = params.handle;
-	sf_handle->root = VBOXSF_SBI(inode->i_sb)->root;
-	sf_handle->access_flags = access_flags;
-	kref_init(&sf_handle->refcount);
+	err = file_update_time(file);
+	if (err)
+		goto fail;
 
-	mutex_lock(&sf_i->handle_list_mutex);
-	list_add(&sf_handle->head, &sf_i->handle_list);
-	mutex_unlock(&sf_i->handle_list_mutex);
+	err = filemap_write_and_wait_range(file->f_mapping, pos,
+					   pos + count - 1);
+	if (err)
+		goto fail;
+
+	for (i = 0; i < 2; i++) {
+		bulk->bufs[i].buf = kvmalloc(bulk->size, GFP_KERNEL);
+		if (!bulk->bufs[i].buf) {
+			err = -ENOMEM;
+			goto fail;
+		}
+	}
 
-	file->private_data = sf_handle;
 	return 0;
+
+fail:
+	vboxsf_bulk_free(bulk);
+	return err;
 }
 
-static void vboxsf_handle_release(struct kref *refcount)
+/*
+ * Write what is left in the fill buffer and drop the (now stale) cached
+ * pages of the written range. Returns the number of bytes written, or an
+ * error if nothing was written.
+ */
+static ssize_t vboxsf_bulk_finish(struct vboxsf_bulk_write *bulk)
 {
-	struct vboxsf_handle *sf_handle =
-		container_of(refcount, struct vboxsf_handle, refcount);
+	struct inode *inode = file_inode(bulk->file);
+	loff_t end;
 
-	vboxsf_close(sf_handle->root, sf_handle->handle);
-	kfree(sf_handle);
+	vboxsf_bulk_submit(bulk);
+	vboxsf_bulk_wait(bulk);
+	vboxsf_bulk_free(bulk);
+
+	if (!bulk->written)
+		return bulk->err;
+
+	end = bulk->start + bulk->written;
+	invalidate_inode_pages2_range(inode->i_mapping,
+				      bulk->start >> PAGE_SHIFT,
+				      (end - 1) >> PAGE_SHIFT);
+	if (end > i_size_read(inode))
+		i_size_write(inode, end);
+
+	vboxsf_note_own_write(inode);
+	vboxsf_record_own_write(inode, bulk->file->private_data);
+
+	return bulk->written;
 }
 
-static int vboxsf_file_release(struct inode *inode, struct file *file)
+struct vboxsf_splice_write {
+	struct vboxsf_bulk_write bulk;
+	struct file *out;
+	bool started;
+};
+
+static int vboxsf_splice_write_actor(struct pipe_inode_info *pipe,
+				     struct pipe_buffer *buf,
+				     struct splice_desc *sd)
 {
-	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
-	struct vboxsf_handle *sf_handle = file->private_data;
+	struct vboxsf_splice_write *sw = sd->u.data;
+	struct vboxsf_bulk_write *bulk = &sw->bulk;
+	struct inode *inode = file_inode(sw->out);
+	unsigned int n, copied = 0;
+	int err;
+	u8 *src;
+
+	err = pipe_buf_confirm(pipe, buf);
+	if (err)
+		return err;
 
 	/*
-	 * When a file is closed on our (the guest) side, we want any subsequent
-	 * accesses done on the host side to see all changes done from our side.
+	 * The inode gets locked at the first buffer, __splice_from_pipe()
+	 * may wait for a slow producer before that, but it does not wait
+	 * anymore once data has been spliced. Anything left of total_len
+	 * may still be in the pipe, write back cached pages for all of it.
 	 */
-	filemap_write_and_wait(inode->i_mapping);
+	if (!sw->started) {
+		inode_lock(inode);
+		err = vboxsf_bulk_init(bulk, sw->out, sd->pos, sd->total_len);
+		if (err) {
+			inode_unlock(inode);
+			return err;
+		}
+		sw->started = true;
+	}
 
-	mutex_lock(&sf_i->handle_list_mutex);
-	list_del(&sf_handle->head);
-	mutex_unlock(&sf_i->handle_list_mutex);
+	src = kmap(buf->page) + buf->offset;
+	while (copied < sd->len) {
+		n = min_t(unsigned int, sd->len - copied,
+			  bulk->size - bulk->fill->len);
+		memcpy(bulk->fill->buf + bulk->fill->len, src + copied, n);
+		bulk->fill->len += n;
+		copied += n;
 
-	kref_put(&sf_handle->refcount, vboxsf_handle_release);
-	return 0;
+		if (bulk->fill->len == bulk->size) {
+			err = vboxsf_bulk_submit(bulk);
+			if (err)
+				break;
+		}
+	}
+	kunmap(buf->page);
+
+	return copied ? copied : err;
 }
 
-/*
- * Write back dirty pages now, because there may not be any suitable
- * open files later
- */
-static void vboxsf_vma_close(struct vm_area_struct *vma)
+static ssize_t vboxsf_file_splice_write(struct pipe_inode_info *pipe,
+					struct file *out, loff_t *ppos,
+					size_t len, unsigned int flags)
 {
-	filemap_write_and_wait(vma->vm_file->f_mapping);
-}
+	struct inode *inode = file_inode(out);
+	struct vboxsf_splice_write sw = { .out = out };
+	struct splice_desc sd = {
+		.flags = flags,
+		.pos = *ppos,
+		.u.data = &sw,
+	};
+	struct kvec kvec = { .iov_len = len };
+	struct iov_iter from;
+	struct kiocb kiocb;
+	ssize_t ret, written;
 
-static const struct vm_operations_struct vboxsf_file_vm_ops = {
-	.close		= vboxsf_vma_close,
-	.fault		= filemap_fault,
-	.map_pages	= filemap_map_pages,
-};
+	/*
+	 * Apply RLIMIT_FSIZE and s_maxbytes, only the count of the iter is
+	 * used. Splicing to O_APPEND files is not allowed, so the checks do
+	 * not depend on i_size and need not be done under the inode lock.
+	 */
+	init_sync_kiocb(&kiocb, out);
+	kiocb.ki_pos = *ppos;
+	iov_iter_kvec(&from, WRITE, &kvec, 1, len);
+	ret = generic_write_checks(&kiocb, &from);
+	if (ret <= 0)
+		return ret;
+	sd.total_len = ret;
 
-static int vboxsf_file_mmap(struct file *file, struct vm_area_struct *vma)
+	pipe_lock(pipe);
+
+	ret = __splice_from_pipe(pipe, &sd, vboxsf_splice_write_actor);
+	if (sw.started) {
+		written = vboxsf_bulk_finish(&sw.bulk);
+		if (written)
+			ret = written;
+		inode_unlock(inode);
+	}
+
+	pipe_unlock(pipe);
+
+	if (ret > 0)
+		*ppos += ret;
+
+	return ret;
+}
+
+static ssize_t vboxsf_file_copy_file_range(struct file *file_in, loff_t pos_in,
+					   struct file *file_out,
+					   loff_t pos_out, size_t len,
+					   unsigned int flags)
 {
+	struct vboxsf_handle *sf_handle_in = file_in->private_data;
+	struct inode *inode_in = file_inode(file_in);
+	struct inode *inode_out = file_inode(file_out);
+	struct vboxsf_bulk_write bulk;
+	struct vboxsf_bulk_buf *b;
+	ssize_t ret;
+	u32 nread;
 	int err;
 
-	err = generic_file_mmap(file, vma);
-	if (!err)
-		vma->vm_ops = &vboxsf_file_vm_ops;
+	/* Only copies within a share can be done without a bounce */
+	if (file_in->f_op != &vboxsf_reg_fops ||
+	    inode_in->i_sb != inode_out->i_sb)
+		return generic_copy_file_range(file_in, pos_in, file_out,
+					       pos_out, len, flags);
 
-	return err;
+	/* The host copy of the source must be uptodate */
+	err = filemap_write_and_wait_range(inode_in->i_mapping, pos_in,
+					   pos_in + len - 1);
+	if (err)
+		return err;
+
+	inode_lock(inode_out);
+
+	ret = vboxsf_bulk_init(&bulk, file_out, pos_out, len);
+	if (ret)
+		goto out_unlock;
+
+	while (len) {
+		b = bulk.fill;
+		nread = min_t(size_t, len, bulk.size - b->len);
+		err = vboxsf_striped_io(inode_in, sf_handle_in, false, pos_in,
+					&nread, b->buf + b->len,
+					vboxsf_io_sync_data);
+		if (err || nread == 0)
+			break;
+
+		b->len += nread;
+		pos_in += nread;
+		len -= nread;
+
+		if (b->len == bulk.size) {
+			err = vboxsf_bulk_submit(&bulk);
+			if (err)
+				break;
+		}
+	}
+
+	ret = vboxsf_bulk_finish(&bulk);
+	if (ret == 0)
+		ret = err;
+
+out_unlock:
+	inode_unlock(inode_out);
+	return ret;
 }
 
-/*
- * Note that since we are accessing files on the host's filesystem, files
- * may always be changed underneath us by the host!
- *
- * The vboxsf API between the guest and the host does not offer any functions
- * to deal with this. There is no inode-generation to check for changes, no
- * events / callback on changes and no way to lock files.
- *
- * To avoid returning stale data when a file gets *opened* on our (the guest)
- * side, we do a "stat" on the host side, then compare the mtime with the
- * last known mtime and invalidate the page-cache if they differ.
- * This is done from vboxsf_inode_revalidate().
- *
- * When reads are done through the read_iter fop, it is possible to do
- * further cache revalidation then, there are 3 options to deal with this:
- *
- * 1)  Rely solely on the revalidation done at open time
- * 2)  Do another "stat" and compare mtime again. Unfortunately the vboxsf
- *     host API does not allow stat on handles, so we would need to use
- *     file->f_path.dentry and the stat will then fail if the file was unlinked
- *     or renamed (and there is no thing like NFS' silly-rename). So we get:
- * 2a) "stat" and compare mtime, on stat failure invalidate the cache
- * 2b) "stat" and compare mtime, on stat failure do nothing
- * 3)  Simply always call invalidate_inode_pages2_range on the range of the read
- *
- * Currently we are keeping things KISS and using option 1. this allows
- * directly using generic_file_read_iter without wrapping it.
- *
- * This means that only data written on the host side before open() on
- * the guest side is guaranteed to be seen by the guest. If necessary
- * we may provide other read-cache strategies in the future and make this
- * configurable through a mount option.
- */
 const struct file_operations vboxsf_reg_fops = {
 	.llseek = generic_file_llseek,
-	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter,
+	.read_iter = vboxsf_file_read_iter,
+	.write_iter = vboxsf_file_write_iter,
 	.mmap = vboxsf_file_mmap,
 	.open = vboxsf_file_open,
 	.release = vboxsf_file_release,
-	.fsync = noop_fsync,
-	.splice_read = generic_file_splice_read,
+	.fsync = vboxsf_file_fsync,
+	.splice_read = vboxsf_file_splice_read,
+	.splice_write = vboxsf_file_splice_write,
+	.copy_file_range = vboxsf_file_copy_file_range,
 };
 
 const struct inode_operations vboxsf_reg_iops = {
@@ -211,14 +1449,21 @@ const struct inode_operations vboxsf_reg_iops = {
 static int vboxsf_readpage(struct file *file, struct page *page)
 {
 	struct vboxsf_handle *sf_handle = file->private_data;
+	struct inode *inode = page->mapping->host;
 	loff_t off = page_offset(page);
 	u32 nread = PAGE_SIZE;
 	u8 *buf;
 	int err;
 
+	/* 0 means the page is being read from the local cache */
+	if (vboxsf_fscache_readpage(inode, page) == 0)
+		return 0;
+
 	buf = kmap(page);
 
-	err = vboxsf_read(sf_handle->root, sf_handle->handle, off, &nread, buf);
+	err = vboxsf_read(sf_handle->root, sf_handle->client_idx,
+			  sf_handle->handle, off, &nread, buf,
+			  vboxsf_io_sync_data);
 	if (err == 0) {
 		memset(&buf[nread], 0, PAGE_SIZE - nread);
 		flush_dcache_page(page);
@@ -228,26 +1473,17 @@ static int vboxsf_readpage(struct file *file, struct page *page)
 	}
 
 	kunmap(page);
+	if (err == 0)
+		vboxsf_fscache_write_page(inode, page);
 	unlock_page(page);
 	return err;
 }
 
-static struct vboxsf_handle *vboxsf_get_write_handle(struct vboxsf_inode *sf_i)
+/* Data integrity writeback (fsync, sync) has somebody waiting for it */
+static enum vboxsf_io_class vboxsf_wbc_io_class(struct writeback_control *wbc)
 {
-	struct vboxsf_handle *h, *sf_handle = NULL;
-
-	mutex_lock(&sf_i->handle_list_mutex);
-	list_for_each_entry(h, &sf_i->handle_list, head) {
-		if (h->access_flags == SHFL_CF_ACCESS_WRITE ||
-		    h->access_flags == SHFL_CF_ACCESS_READWRITE) {
-			kref_get(&h->refcount);
-			sf_handle = h;
-			break;
-		}
-	}
-	mutex_unlock(&sf_i->handle_list_mutex);
-
-	return sf_handle;
+	return wbc->sync_mode == WB_SYNC_ALL ? vboxsf_io_sync_data :
+					       vboxsf_io_writeback;
 }
 
 static int vboxsf_writepage(struct page *page, struct writeback_control *wbc)
@@ -265,28 +1501,52 @@ static int vboxsf_writepage(struct page *page, struct writeback_control *wbc)
 		nwrite = size & ~PAGE_MASK;
 
 	sf_handle = vboxsf_get_write_handle(sf_i);
-	if (!sf_handle)
+	if (!sf_handle) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
 		return -EBADF;
+	}
 
 	buf = kmap(page);
-	err = vboxsf_write(sf_handle->root, sf_handle->handle,
-			   off, &nwrite, buf);
+	err = vboxsf_write(sf_handle->root, sf_handle->client_idx,
+			   sf_handle->handle, off, &nwrite, buf,
+			   vboxsf_wbc_io_class(wbc));
 	kunmap(page);
 
-	kref_put(&sf_handle->refcount, vboxsf_handle_release);
-
 	if (err == 0) {
 		ClearPageError(page);
-		/* mtime changed */
-		sf_i->force_restat = 1;
+		vboxsf_note_own_write(inode);
 	} else {
 		ClearPageUptodate(page);
 	}
 
+	kref_put(&sf_handle->refcount, vboxsf_handle_release);
+
 	unlock_page(page);
 	return err;
 }
 
+/*
+ * With the exclusive mount option nobody else modifies the file, so we can
+ * simply dirty the page and leave writing it to the host to writepage.
+ * This is only safe if the page contents are fully known: the page is
+ * uptodate, fully overwritten, or entirely beyond the old EOF (in which
+ * case simple_write_begin has zeroed the rest of it).
+ * O_APPEND handles are never used by writepage, so those write through.
+ */
+static bool vboxsf_can_defer_write(struct file *file, struct page *page,
+				   unsigned int copied)
+{
+	struct inode *inode = page->mapping->host;
+
+	if (!VBOXSF_SBI(inode->i_sb)->o.exclusive ||
+	    (file->f_flags & O_APPEND))
+		return false;
+
+	return PageUptodate(page) || copied == PAGE_SIZE ||
+	       page_offset(page) >= i_size_read(inode);
+}
+
 static int vboxsf_write_end(struct file *file, struct address_space *mapping,
 			    loff_t pos, unsigned int len, unsigned int copied,
 			    struct page *page, void *fsdata)
@@ -302,9 +1562,17 @@ static int vboxsf_write_end(struct file *file, struct address_space *mapping,
 	if (!PageUptodate(page) && copied < len)
 		zero_user(page, from + copied, len - copied);
 
+	if (vboxsf_can_defer_write(file, page, copied)) {
+		SetPageUptodate(page);
+		set_page_dirty(page);
+		nwritten = copied;
+		goto update_size;
+	}
+
 	buf = kmap(page);
-	err = vboxsf_write(sf_handle->root, sf_handle->handle,
-			   pos, &nwritten, buf + from);
+	err = vboxsf_write(sf_handle->root, sf_handle->client_idx,
+			   sf_handle->handle, pos, &nwritten, buf + from,
+			   vboxsf_io_sync_data);
 	kunmap(page);
 
 	if (err) {
@@ -312,12 +1580,12 @@ static int vboxsf_write_end(struct file *file, struct address_space *mapping,
 		goto out;
 	}
 
-	/* mtime changed */
-	VBOXSF_I(inode)->force_restat = 1;
+	vboxsf_note_own_write(inode);
 
 	if (!PageUptodate(page) && nwritten == PAGE_SIZE)
 		SetPageUptodate(page);
 
+update_size:
 	pos += nwritten;
 	if (pos > inode->i_size)
 		i_size_write(inode, pos);
@@ -329,6 +1597,188 @@ out:
 	return nwritten;
 }
 
+static int vboxsf_releasepage(struct page *page, gfp_t gfp)
+{
+	if (PagePrivate(page))
+		return 0;
+
+	return vboxsf_fscache_release_page(page, gfp);
+}
+
+static void vboxsf_invalidatepage(struct page *page, unsigned int offset,
+				  unsigned int length)
+{
+	if (offset == 0 && length == PAGE_SIZE)
+		vboxsf_fscache_invalidate_page(page);
+}
+
+/*
+ * Writing back pages costs a host round trip per run of dirty pages. To not
+ * have the single flusher thread write back all dirty inodes one after the
+ * other, non-integrity (WB_SYNC_NONE) writeback writes the first batch inline
+ * and hands the rest off to the per mount writeback workqueue, which writes
+ * back many inodes concurrently. Integrity writeback (fsync, sync) first waits
+ * for any queued async writeback. The work does not pin the inode, eviction
+ * cancels it instead.
+ */
+struct vboxsf_wb_batch {
+	struct vboxsf_handle *sf_handle;
+	enum vboxsf_io_class class;
+	unsigned int nr_pages;
+	struct page *pages[VBOXSF_MAX_IO_PAGES];
+};
+
+/* Write a run of consecutive pages under writeback with one host call */
+static int vboxsf_wb_batch_flush(struct inode *inode,
+				 struct vboxsf_wb_batch *b)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	loff_t off = page_offset(b->pages[0]);
+	loff_t size = i_size_read(inode);
+	u32 nwrite = b->nr_pages * PAGE_SIZE;
+	unsigned int i;
+	int err = 0;
+	u8 *buf;
+
+	if (off + nwrite > size)
+		nwrite = size > off ? size - off : 0;
+
+	vboxsf_stats_inc(sbi, wb_batches);
+	vboxsf_stats_add(sbi, wb_pages, b->nr_pages);
+
+	if (nwrite) {
+		buf = vmap(b->pages, b->nr_pages, VM_MAP, PAGE_KERNEL);
+		if (buf) {
+			err = vboxsf_striped_io(inode, b->sf_handle, true,
+						off, &nwrite, buf, b->class);
+			vunmap(buf);
+		} else {
+			err = -ENOMEM;
+		}
+	}
+
+	if (err == 0)
+		vboxsf_note_own_write(inode);
+	else
+		mapping_set_error(inode->i_mapping, err);
+
+	for (i = 0; i < b->nr_pages; i++) {
+		if (err)
+			SetPageError(b->pages[i]);
+		else
+			ClearPageError(b->pages[i]);
+		end_page_writeback(b->pages[i]);
+	}
+
+	b->nr_pages = 0;
+	return err;
+}
+
+static int vboxsf_writepages_cb(struct page *page,
+				struct writeback_control *wbc, void *data)
+{
+	struct inode *inode = page->mapping->host;
+	struct vboxsf_wb_batch *b = data;
+	int err = 0;
+
+	if (b->nr_pages &&
+	    (b->nr_pages == VBOXSF_MAX_IO_PAGES ||
+	     b->pages[b->nr_pages - 1]->index + 1 != page->index))
+		err = vboxsf_wb_batch_flush(inode, b);
+
+	set_page_writeback(page);
+	unlock_page(page);
+	b->pages[b->nr_pages++] = page;
+
+	return err;
+}
+
+/*
+ * Write back dirty pages, coalescing runs of consecutive dirty pages (up to
+ * VBOXSF_MAX_IO_PAGES) into a single host write.
+ */
+static int vboxsf_do_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct vboxsf_wb_batch *b;
+	int err, flush_err = 0;
+
+	b = kmalloc(sizeof(*b), GFP_NOFS);
+	if (!b)
+		return -ENOMEM;
+
+	/* Leave the pages dirty if there is nothing to write them with */
+	b->sf_handle = vboxsf_get_write_handle(VBOXSF_I(inode));
+	if (!b->sf_handle) {
+		kfree(b);
+		return -EBADF;
+	}
+	b->nr_pages = 0;
+	b->class = vboxsf_wbc_io_class(wbc);
+
+	err = write_cache_pages(mapping, wbc, vboxsf_writepages_cb, b);
+	if (b->nr_pages)
+		flush_err = vboxsf_wb_batch_flush(inode, b);
+
+	vboxsf_record_own_write(inode, b->sf_handle);
+	vboxsf_put_handle(b->sf_handle);
+	kfree(b);
+	return err ? err : flush_err;
+}
+
+void vboxsf_wb_work(struct work_struct *work)
+{
+	struct vboxsf_inode *sf_i = container_of(work, struct vboxsf_inode,
+						 wb_work);
+	struct inode *inode = &sf_i->vfs_inode;
+	struct vboxsf_handle *sf_handle;
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+		.nr_to_write = LONG_MAX,
+		.range_start = 0,
+		.range_end = LLONG_MAX,
+	};
+
+	/* Write errors are recorded in the mapping by vboxsf_wb_batch_flush */
+	vboxsf_do_writepages(inode->i_mapping, &wbc);
+
+	/* Requested by vboxsf_sync_fs */
+	if (xchg(&sf_i->flush_requested, 0) && sf_i->needs_flush) {
+		sf_handle = vboxsf_get_handle(sf_i);
+		if (sf_handle) {
+			vboxsf_flush_handle(sf_i, sf_handle);
+			vboxsf_put_handle(sf_handle);
+		}
+	}
+}
+
+static int vboxsf_writepages(struct address_space *mapping,
+			     struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	long nr_to_write, nr_batch;
+	int err;
+
+	if (wbc->sync_mode == WB_SYNC_NONE) {
+		nr_to_write = wbc->nr_to_write;
+		nr_batch = min_t(long, nr_to_write, VBOXSF_MAX_IO_PAGES);
+
+		wbc->nr_to_write = nr_batch;
+		err = vboxsf_do_writepages(mapping, wbc);
+		wbc->nr_to_write = nr_to_write - (nr_batch - wbc->nr_to_write);
+
+		if (mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+			queue_work(sbi->wb_wq, &sf_i->wb_work);
+		return err;
+	}
+
+	flush_work(&sf_i->wb_work);
+	return vboxsf_do_writepages(mapping, wbc);
+}
+
 /*
  * Note simple_write_begin does not read the page from disk on partial writes
  * this is ok since vboxsf_write_end only writes the written parts of the
@@ -336,44 +1786,153 @@ out:
  */
 const struct address_space_operations vboxsf_reg_aops = {
 	.readpage = vboxsf_readpage,
+	.readpages = vboxsf_readpages,
 	.writepage = vboxsf_writepage,
+	.writepages = vboxsf_writepages,
 	.set_page_dirty = __set_page_dirty_nobuffers,
 	.write_begin = simple_write_begin,
 	.write_end = vboxsf_write_end,
+	.releasepage = vboxsf_releasepage,
+	.invalidatepage = vboxsf_invalidatepage,
 };
 
-static const char *vboxsf_get_link(struct dentry *dentry, struct inode *inode,
-				   struct delayed_call *done)
+static void vboxsf_link_release(struct kref *refcount)
+{
+	struct vboxsf_link *link = container_of(refcount, struct vboxsf_link,
+						refcount);
+
+	kfree_rcu(link, rcu);
+}
+
+static void vboxsf_link_put(void *arg)
+{
+	struct vboxsf_link *link = arg;
+
+	kref_put(&link->refcount, vboxsf_link_release);
+}
+
+/* Replace the cached symlink target of @inode with @link, may be NULL */
+static void vboxsf_link_set(struct inode *inode, struct vboxsf_link *link)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_link *old;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	old = rcu_dereference_protected(sf_i->link,
+				lockdep_is_held(&sf_i->handle_list_mutex));
+	rcu_assign_pointer(sf_i->link, link);
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (old)
+		vboxsf_link_put(old);
+}
+
+void vboxsf_link_drop(struct inode *inode)
+{
+	vboxsf_link_set(inode, NULL);
+}
+
+/*
+ * The cached target is valid as long as the symlink's mtime is unchanged.
+ * The attributes of the symlink get revalidated by the path walk before it
+ * is followed, so the target is as fresh as the attributes are.
+ */
+static bool vboxsf_link_valid(struct inode *inode, struct vboxsf_link *link)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+
+	return !READ_ONCE(VBOXSF_I(inode)->force_restat) &&
+	       !time_before(link->read_time, sbi->inval_time) &&
+	       timespec64_equal(&link->mtime, &inode->i_mtime);
+}
+
+static struct vboxsf_link *vboxsf_link_read(struct dentry *dentry,
+					    struct inode *inode)
 {
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct timespec64 mtime = inode->i_mtime;
+	unsigned long read_time = jiffies;
+	struct vboxsf_link *link;
 	struct shfl_string *path;
-	char *link;
+	size_t len;
+	char *buf;
 	int err;
 
-	if (!dentry)
-		return ERR_PTR(-ECHILD);
-
 	path = vboxsf_path_from_dentry(sbi, dentry);
 	if (IS_ERR(path))
-		return (char *)path;
+		return ERR_CAST(path);
 
-	link = kzalloc(PATH_MAX, GFP_KERNEL);
-	if (!link) {
+	buf = kzalloc(PATH_MAX, GFP_KERNEL);
+	if (!buf) {
 		__putname(path);
 		return ERR_PTR(-ENOMEM);
 	}
 
-	err = vboxsf_readlink(sbi->root, path, PATH_MAX, link);
+	err = vboxsf_readlink(sbi->root, path, PATH_MAX, buf);
 	__putname(path);
 	if (err) {
-		kfree(link);
-		return ERR_PTR(err);
+		link = ERR_PTR(err);
+		goto out_free_buf;
+	}
+
+	len = strnlen(buf, PATH_MAX - 1);
+	link = kmalloc(struct_size(link, target, len + 1), GFP_KERNEL);
+	if (!link) {
+		link = ERR_PTR(-ENOMEM);
+		goto out_free_buf;
 	}
 
-	set_delayed_call(done, kfree_link, link);
+	kref_init(&link->refcount);
+	link->mtime = mtime;
+	link->read_time = read_time;
+	memcpy(link->target, buf, len);
+	link->target[len] = 0;
+
+out_free_buf:
+	kfree(buf);
 	return link;
 }
 
+/*
+ * Symlink farms (node_modules/.bin, versioned toolchain links) get traversed
+ * constantly, so the target is cached on the inode in a right sized buffer.
+ * Cached targets are served in RCU walk mode without allocating or calling
+ * the host, ref walk mode takes a reference which is dropped through @done.
+ */
+static const char *vboxsf_get_link(struct dentry *dentry, struct inode *inode,
+				   struct delayed_call *done)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_link *link;
+
+	if (!dentry) {
+		/* RCU walk, the caller holds rcu_read_lock */
+		link = rcu_dereference(sf_i->link);
+		if (link && vboxsf_link_valid(inode, link))
+			return link->target;
+		return ERR_PTR(-ECHILD);
+	}
+
+	rcu_read_lock();
+	link = rcu_dereference(sf_i->link);
+	if (link && (!vboxsf_link_valid(inode, link) ||
+		     !kref_get_unless_zero(&link->refcount)))
+		link = NULL;
+	rcu_read_unlock();
+
+	if (!link) {
+		link = vboxsf_link_read(dentry, inode);
+		if (IS_ERR(link))
+			return ERR_CAST(link);
+
+		kref_get(&link->refcount);
+		vboxsf_link_set(inode, link);
+	}
+
+	set_delayed_call(done, vboxsf_link_put, link);
+	return link->target;
+}
+
 const struct inode_operations vboxsf_lnk_iops = {
 	.get_link = vboxsf_get_link
 };
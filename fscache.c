@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: MIT
+/*
+ * VirtualBox Guest Shared Folders support: Local persistent page-cache
+ * through fscache / cachefiles.
+ *
+ * Each mount with the "fsc" option gets an index cookie keyed by the share
+ * name, each regular file inode gets a data cookie below it keyed by the
+ * host's inode_id_device + inode_id. The host mtime + size are used as
+ * coherency (aux) data, so cached data is discarded when the file was
+ * changed on the host while it was not cached by us.
+ *
+ * Like NFS, files are only cached while they are not opened for writing,
+ * opening a file for writing disables the inode's cookie and discards the
+ * cached data. The cookie stays attached to the inode until it is evicted,
+ * so readpage(s) never see it go away underneath them.
+ */
+
+#include <linux/fscache.h>
+#include <linux/pagemap.h>
+#include <linux/vbox_utils.h>
+#include "vfsmod.h"
+
+struct vboxsf_fscache_key {
+	u64 inode_id;
+	u32 inode_id_device;
+} __packed;
+
+struct vboxsf_fscache_aux {
+	s64 mtime;
+	s64 size;
+} __packed;
+
+static struct fscache_netfs vboxsf_cache_netfs = {
+	.name		= "vboxsf",
+	.version	= 0,
+};
+
+static const struct fscache_cookie_def vboxsf_cache_session_index_def = {
+	.name		= "vboxsf.session",
+	.type		= FSCACHE_COOKIE_TYPE_INDEX,
+};
+
+static void vboxsf_fscache_fill_aux(struct inode *inode,
+				    struct vboxsf_fscache_aux *aux)
+{
+	memset(aux, 0, sizeof(*aux));
+	aux->mtime = timespec64_to_ns(&inode->i_mtime);
+	aux->size = i_size_read(inode);
+}
+
+static enum fscache_checkaux vboxsf_fscache_check_aux(void *cookie_netfs_data,
+						      const void *buffer,
+						      u16 buflen,
+						      loff_t object_size)
+{
+	struct vboxsf_fscache_aux aux;
+
+	vboxsf_fscache_fill_aux(cookie_netfs_data, &aux);
+
+	if (buflen != sizeof(aux) || memcmp(buffer, &aux, sizeof(aux)))
+		return FSCACHE_CHECKAUX_OBSOLETE;
+
+	return FSCACHE_CHECKAUX_OKAY;
+}
+
+static const struct fscache_cookie_def vboxsf_cache_inode_index_def = {
+	.name		= "vboxsf.inode",
+	.type		= FSCACHE_COOKIE_TYPE_DATAFILE,
+	.check_aux	= vboxsf_fscache_check_aux,
+};
+
+int vboxsf_fscache_register(void)
+{
+	return fscache_register_netfs(&vboxsf_cache_netfs);
+}
+
+void vboxsf_fscache_unregister(void)
+{
+	fscache_unregister_netfs(&vboxsf_cache_netfs);
+}
+
+void vboxsf_fscache_get_session_cookie(struct vboxsf_sbi *sbi,
+				       const char *share_name)
+{
+	sbi->fscache = fscache_acquire_cookie(vboxsf_cache_netfs.primary_index,
+					      &vboxsf_cache_session_index_def,
+					      share_name, strlen(share_name),
+					      NULL, 0, sbi, 0, true);
+	if (!sbi->fscache)
+		vbg_warn("vboxsf: Unable to get fscache cookie for '%s'\n",
+			 share_name);
+}
+
+void vboxsf_fscache_put_session_cookie(struct vboxsf_sbi *sbi)
+{
+	fscache_relinquish_cookie(sbi->fscache, NULL, false);
+	sbi->fscache = NULL;
+}
+
+static bool vboxsf_fscache_can_enable(void *data)
+{
+	struct inode *inode = data;
+
+	return !inode_is_open_for_write(inode);
+}
+
+static void vboxsf_fscache_enable_inode_cookie(struct inode *inode)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_fscache_key key = {};
+	struct vboxsf_fscache_aux aux;
+	bool enable;
+
+	vboxsf_fscache_fill_aux(inode, &aux);
+
+	if (sf_i->fscache) {
+		fscache_enable_cookie(sf_i->fscache, &aux, i_size_read(inode),
+				      vboxsf_fscache_can_enable, inode);
+		return;
+	}
+
+	/* Without a host inode_id we have nothing stable to key on */
+	if (!sbi->fscache || !sf_i->host_inode_id)
+		return;
+
+	enable = vboxsf_fscache_can_enable(inode);
+	key.inode_id = sf_i->host_inode_id;
+	key.inode_id_device = sf_i->host_inode_id_device;
+
+	sf_i->fscache = fscache_acquire_cookie(sbi->fscache,
+					       &vboxsf_cache_inode_index_def,
+					       &key, sizeof(key),
+					       &aux, sizeof(aux),
+					       inode, i_size_read(inode),
+					       enable);
+}
+
+/*
+ * Disabling the cookie waits for the reads and writes in flight on it,
+ * after that no new pages get marked, so all PG_fscache marks can be
+ * cleared.
+ */
+static void vboxsf_fscache_disable_inode_cookie(struct inode *inode)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_fscache_aux aux;
+
+	if (!sf_i->fscache)
+		return;
+
+	vboxsf_fscache_fill_aux(inode, &aux);
+	fscache_disable_cookie(sf_i->fscache, &aux, true);
+	fscache_uncache_all_inode_pages(sf_i->fscache, inode);
+}
+
+void vboxsf_fscache_put_inode_cookie(struct inode *inode)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_fscache_aux aux;
+
+	if (!sf_i->fscache)
+		return;
+
+	vboxsf_fscache_fill_aux(inode, &aux);
+	fscache_relinquish_cookie(sf_i->fscache, &aux, false);
+	sf_i->fscache = NULL;
+}
+
+void vboxsf_fscache_open(struct inode *inode, struct file *file)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+
+	mutex_lock(&sf_i->fscache_lock);
+
+	if ((file->f_flags & O_ACCMODE) != O_RDONLY)
+		vboxsf_fscache_disable_inode_cookie(inode);
+	else
+		vboxsf_fscache_enable_inode_cookie(inode);
+
+	mutex_unlock(&sf_i->fscache_lock);
+}
+
+/* The host copy changed underneath us, drop the locally cached data */
+void vboxsf_fscache_invalidate(struct inode *inode)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_fscache_aux aux;
+
+	if (!sf_i->fscache)
+		return;
+
+	vboxsf_fscache_fill_aux(inode, &aux);
+	fscache_update_cookie(sf_i->fscache, &aux);
+	fscache_invalidate(sf_i->fscache);
+}
+
+static void vboxsf_fscache_read_complete(struct page *page, void *data,
+					 int error)
+{
+	if (!error)
+		SetPageUptodate(page);
+
+	unlock_page(page);
+}
+
+/*
+ * Returns 0 if the page is being read from the cache (the page will be
+ * unlocked on completion) and 1 if the page must be read from the host.
+ */
+int vboxsf_fscache_readpage(struct inode *inode, struct page *page)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+
+	if (!sf_i->fscache)
+		return 1;
+
+	/* -ENOBUFS / -ENODATA: not cached, other errors: fall back to host */
+	if (fscache_read_or_alloc_page(sf_i->fscache, page,
+				       vboxsf_fscache_read_complete,
+				       NULL, GFP_KERNEL))
+		return 1;
+
+	return 0;
+}
+
+/* Store a page freshly read from the host in the cache */
+void vboxsf_fscache_write_page(struct inode *inode, struct page *page)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+
+	/* Only pages which read_or_alloc_page() marked can be stored */
+	if (!sf_i->fscache || !PageFsCache(page))
+		return;
+
+	if (fscache_write_page(sf_i->fscache, page, i_size_read(inode),
+			       GFP_KERNEL))
+		fscache_uncache_page(sf_i->fscache, page);
+}
+
+int vboxsf_fscache_release_page(struct page *page, gfp_t gfp)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(page->mapping->host);
+
+	return fscache_maybe_release_page(sf_i->fscache, page, gfp);
+}
+
+void vboxsf_fscache_invalidate_page(struct page *page)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(page->mapping->host);
+
+	if (PageFsCache(page)) {
+		fscache_wait_on_page_write(sf_i->fscache, page);
+		fscache_uncache_page(sf_i->fscache, page);
+	}
+}
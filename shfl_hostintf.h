@@ -651,6 +651,26 @@ struct shfl_write {
 #define SHFL_CPARMS_WRITE (5)
 
 
+/** SHFL_FN_FLUSH Parameters structure. */
+struct shfl_flush {
+	/**
+	 * pointer, in: SHFLROOT (u32)
+	 * Root handle of the mapping which name is queried.
+	 */
+	struct vmmdev_hgcm_function_parameter root;
+
+	/**
+	 * value64, in:
+	 * SHFLHANDLE (u64) of object to flush.
+	 */
+	struct vmmdev_hgcm_function_parameter handle;
+
+};
+
+/* Number of parameters */
+#define SHFL_CPARMS_FLUSH (2)
+
+
 /*
  * SHFL_FN_LIST
  * Listing information includes variable length RTDIRENTRY[EX] structures.
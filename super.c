@@ -15,6 +15,7 @@
 #include <linux/magic.h>
 #include <linux/module.h>
 #include <linux/nls.h>
+#include <linux/seq_file.h>
 #include <linux/statfs.h>
 #include <linux/vbox_utils.h>
 #include "vfsmod.h"
@@ -31,6 +32,11 @@ module_param(follow_symlinks, int, 0444);
 MODULE_PARM_DESC(follow_symlinks,
 		 "Let host resolve symlinks rather than showing them");
 
+static unsigned int hgcm_clients;
+module_param(hgcm_clients, uint, 0444);
+MODULE_PARM_DESC(hgcm_clients,
+		 "Number of host connections, 0 for one per CPU (max 16)");
+
 static DEFINE_IDA(vboxsf_bdi_ida);
 static DEFINE_MUTEX(vboxsf_setup_mutex);
 static bool vboxsf_setup_done;
@@ -40,7 +46,9 @@ static struct kmem_cache *vboxsf_inode_cachep;
 static char * const vboxsf_default_nls = CONFIG_NLS_DEFAULT;
 
 enum  { opt_nls, opt_uid, opt_gid, opt_ttl, opt_dmode, opt_fmode,
-	opt_dmask, opt_fmask };
+	opt_dmask, opt_fmask, opt_cache, opt_fsc, opt_exclusive,
+	opt_denywrite, opt_strictclose, opt_stripes, opt_stripe_size,
+	opt_statfs_ttl };
 
 static const struct fs_parameter_spec vboxsf_param_specs[] = {
 	fsparam_string	("nls",		opt_nls),
@@ -51,12 +59,29 @@ static const struct fs_parameter_spec vboxsf_param_specs[] = {
 	fsparam_u32oct	("fmode",	opt_fmode),
 	fsparam_u32oct	("dmask",	opt_dmask),
 	fsparam_u32oct	("fmask",	opt_fmask),
+	fsparam_enum	("cache",	opt_cache),
+	fsparam_flag	("fsc",		opt_fsc),
+	fsparam_flag	("exclusive",	opt_exclusive),
+	fsparam_flag	("denywrite",	opt_denywrite),
+	fsparam_flag	("strictclose",	opt_strictclose),
+	fsparam_u32	("stripes",	opt_stripes),
+	fsparam_u32	("stripesize",	opt_stripe_size),
+	fsparam_u32	("statfsttl",	opt_statfs_ttl),
+	{}
+};
+
+static const struct fs_parameter_enum vboxsf_param_enums[] = {
+	{ opt_cache,	"open",		vboxsf_cache_open },
+	{ opt_cache,	"none",		vboxsf_cache_none },
+	{ opt_cache,	"strict",	vboxsf_cache_strict },
+	{ opt_cache,	"loose",	vboxsf_cache_loose },
 	{}
 };
 
 static const struct fs_parameter_description vboxsf_fs_parameters = {
 	.name  = "vboxsf",
 	.specs  = vboxsf_param_specs,
+	.enums  = vboxsf_param_enums,
 };
 
 static int vboxsf_parse_param(struct fs_context *fc, struct fs_parameter *param)
@@ -117,6 +142,40 @@ static int vboxsf_parse_param(struct fs_context *fc, struct fs_parameter *param)
 			return -EINVAL;
 		ctx->o.fmask = result.uint_32;
 		break;
+	case opt_cache:
+		ctx->o.cache = result.uint_32;
+		break;
+	case opt_fsc:
+		if (fc->purpose != FS_CONTEXT_FOR_MOUNT) {
+			vbg_err("vboxsf: Cannot reconfigure fsc option\n");
+			return -EINVAL;
+		}
+		ctx->o.fscache = true;
+		break;
+	case opt_exclusive:
+		ctx->o.exclusive = true;
+		break;
+	case opt_denywrite:
+		ctx->o.denywrite = true;
+		break;
+	case opt_strictclose:
+		ctx->o.strictclose = true;
+		break;
+	case opt_stripes:
+		if (result.uint_32 < 1 || result.uint_32 > VBOXSF_MAX_STRIPES)
+			return -EINVAL;
+		ctx->o.stripes = result.uint_32;
+		break;
+	case opt_stripe_size:
+		if (result.uint_32 < PAGE_SIZE ||
+		    result.uint_32 > SHFL_MAX_RW_COUNT ||
+		    !PAGE_ALIGNED(result.uint_32))
+			return -EINVAL;
+		ctx->o.stripe_size = result.uint_32;
+		break;
+	case opt_statfs_ttl:
+		ctx->o.statfs_ttl = msecs_to_jiffies(result.uint_32);
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -124,10 +183,45 @@ static int vboxsf_parse_param(struct fs_context *fc, struct fs_parameter *param)
 	return 0;
 }
 
+/* Read the volume info from the host and update the statfs cache */
+static int vboxsf_volinfo_refresh(struct vboxsf_sbi *sbi,
+				  struct shfl_volinfo *volinfo,
+				  enum vboxsf_io_class class)
+{
+	unsigned long now = jiffies;
+	u32 buf_len = sizeof(*volinfo);
+	int err;
+
+	/* Not handle bound, any client will do */
+	err = vboxsf_fsinfo(sbi->root, 0, 0, SHFL_INFO_GET | SHFL_INFO_VOLUME,
+			    &buf_len, volinfo, class);
+	if (err)
+		return err;
+
+	spin_lock(&sbi->volinfo_lock);
+	sbi->volinfo = *volinfo;
+	sbi->volinfo_time = now;
+	sbi->volinfo_valid = true;
+	spin_unlock(&sbi->volinfo_lock);
+
+	return 0;
+}
+
+static void vboxsf_volinfo_work(struct work_struct *work)
+{
+	struct vboxsf_sbi *sbi = container_of(work, struct vboxsf_sbi,
+					      volinfo_work);
+	struct shfl_volinfo volinfo;
+
+	/* Nobody waits for this, the cached info is returned meanwhile */
+	vboxsf_volinfo_refresh(sbi, &volinfo, vboxsf_io_prefetch);
+}
+
 static int vboxsf_fill_super(struct super_block *sb, struct fs_context *fc)
 {
 	struct vboxsf_fs_context *ctx = fc->fs_private;
 	struct shfl_string *folder_name, root_path;
+	struct shfl_volinfo volinfo;
 	struct vboxsf_sbi *sbi;
 	struct dentry *droot;
 	struct inode *iroot;
@@ -147,6 +241,12 @@ static int vboxsf_fill_super(struct super_block *sb, struct fs_context *fc)
 	spin_lock_init(&sbi->ino_idr_lock);
 	sbi->next_generation = 1;
 	sbi->bdi_id = -1;
+	sbi->inval_time = jiffies;
+	INIT_LIST_HEAD(&sbi->close_list);
+	spin_lock_init(&sbi->close_lock);
+	INIT_WORK(&sbi->close_work, vboxsf_close_work);
+	spin_lock_init(&sbi->volinfo_lock);
+	INIT_WORK(&sbi->volinfo_work, vboxsf_volinfo_work);
 
 	/* Load nls if not utf8 */
 	nls_name = ctx->nls_name ? ctx->nls_name : vboxsf_default_nls;
@@ -173,6 +273,35 @@ static int vboxsf_fill_super(struct super_block *sb, struct fs_context *fc)
 	if (err)
 		goto fail_free;
 
+	/* Allow readahead to fill a whole multi-page host read */
+	sb->s_bdi->ra_pages = VBOXSF_MAX_IO_PAGES;
+	sb->s_bdi->io_pages = VBOXSF_MAX_IO_PAGES;
+
+	sbi->wq = alloc_workqueue("vboxsf-%d", WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+				  sbi->bdi_id);
+	if (!sbi->wq) {
+		err = -ENOMEM;
+		goto fail_free;
+	}
+
+	/* Stripes are waited for from sbi->wq, so they need their own wq */
+	sbi->stripe_wq = alloc_workqueue("vboxsf-stripe-%d",
+					 WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+					 sbi->bdi_id);
+	if (!sbi->stripe_wq) {
+		err = -ENOMEM;
+		goto fail_free;
+	}
+
+	/* Close and mmap work wait for async writeback, so it gets one too */
+	sbi->wb_wq = alloc_workqueue("vboxsf-wb-%d",
+				     WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+				     sbi->bdi_id);
+	if (!sbi->wb_wq) {
+		err = -ENOMEM;
+		goto fail_free;
+	}
+
 	/* Turn source into a shfl_string and map the folder */
 	size = strlen(fc->source) + 1;
 	folder_name = kmalloc(SHFLSTRING_HEADER_SIZE + size, GFP_KERNEL);
@@ -190,6 +319,7 @@ static int vboxsf_fill_super(struct super_block *sb, struct fs_context *fc)
 			fc->source, err);
 		goto fail_free;
 	}
+	sbi->stats = vboxsf_root_stats(sbi->root);
 
 	root_path.length = 1;
 	root_path.size = 2;
@@ -199,6 +329,16 @@ static int vboxsf_fill_super(struct super_block *sb, struct fs_context *fc)
 	if (err)
 		goto fail_unmap;
 
+	/*
+	 * If this fails assume case insensitive, that is the safe choice.
+	 * This also primes the statfs cache.
+	 */
+	if (vboxsf_volinfo_refresh(sbi, &volinfo, vboxsf_io_sync_meta) == 0)
+		sbi->case_sensitive = volinfo.properties.case_sensitive;
+
+	if (sbi->o.fscache)
+		vboxsf_fscache_get_session_cookie(sbi, fc->source);
+
 	sb->s_magic = VBOXSF_SUPER_MAGIC;
 	sb->s_blocksize = 1024;
 	sb->s_maxbytes = MAX_LFS_FILESIZE;
@@ -208,7 +348,7 @@ static int vboxsf_fill_super(struct super_block *sb, struct fs_context *fc)
 	iroot = iget_locked(sb, 0);
 	if (!iroot) {
 		err = -ENOMEM;
-		goto fail_unmap;
+		goto fail_put_cookie;
 	}
 	vboxsf_init_inode(sbi, iroot, &sbi->root_info);
 	unlock_new_inode(iroot);
@@ -216,16 +356,24 @@ static int vboxsf_fill_super(struct super_block *sb, struct fs_context *fc)
 	droot = d_make_root(iroot);
 	if (!droot) {
 		err = -ENOMEM;
-		goto fail_unmap;
+		goto fail_put_cookie;
 	}
 
 	sb->s_root = droot;
 	sb->s_fs_info = sbi;
 	return 0;
 
+fail_put_cookie:
+	vboxsf_fscache_put_session_cookie(sbi);
 fail_unmap:
 	vboxsf_unmap_folder(sbi->root);
 fail_free:
+	if (sbi->wb_wq)
+		destroy_workqueue(sbi->wb_wq);
+	if (sbi->stripe_wq)
+		destroy_workqueue(sbi->stripe_wq);
+	if (sbi->wq)
+		destroy_workqueue(sbi->wq);
 	if (sbi->bdi_id >= 0)
 		ida_simple_remove(&vboxsf_bdi_ida, sbi->bdi_id);
 	if (sbi->nls)
@@ -240,6 +388,11 @@ static void vboxsf_inode_init_once(void *data)
 	struct vboxsf_inode *sf_i = data;
 
 	mutex_init(&sf_i->handle_list_mutex);
+	mutex_init(&sf_i->flush_mutex);
+	mutex_init(&sf_i->stat_mutex);
+#if IS_ENABLED(CONFIG_FSCACHE)
+	mutex_init(&sf_i->fscache_lock);
+#endif
 	inode_init_once(&sf_i->vfs_inode);
 }
 
@@ -252,11 +405,55 @@ static struct inode *vboxsf_alloc_inode(struct super_block *sb)
 		return NULL;
 
 	sf_i->force_restat = 0;
+	sf_i->attr_time = jiffies;
+	sf_i->own_write = 0;
+	sf_i->own_mtime = 0;
+	sf_i->own_size = 0;
+	sf_i->own_write_pending = 0;
+	sf_i->host_inode_id_device = 0;
+	sf_i->host_inode_id = 0;
+	sf_i->deny_write_count = 0;
+	sf_i->close_count = 0;
+	sf_i->needs_flush = 0;
+	sf_i->flush_requested = 0;
+	INIT_WORK(&sf_i->wb_work, vboxsf_wb_work);
+	sf_i->flush_gen = 0;
+	sf_i->flush_err = 0;
+	sf_i->stat_gen = 0;
+	sf_i->stat_err = 0;
+	sf_i->mmap_handle = NULL;
+	sf_i->mmap_count = 0;
+	INIT_WORK(&sf_i->mmap_work, vboxsf_mmap_work);
+	RCU_INIT_POINTER(sf_i->link, NULL);
+	sf_i->dir_cache = NULL;
+	sf_i->lookup_dir = NULL;
+	sf_i->lookup_count = 0;
+	sf_i->lookup_window = jiffies;
+	sf_i->lookup_gen = 0;
+	sf_i->lookup_fetching = 0;
+#if IS_ENABLED(CONFIG_FSCACHE)
+	sf_i->fscache = NULL;
+#endif
 	INIT_LIST_HEAD(&sf_i->handle_list);
 
 	return &sf_i->vfs_inode;
 }
 
+static void vboxsf_evict_inode(struct inode *inode)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+
+	/* Queued async writeback does not hold an inode reference */
+	cancel_work_sync(&sf_i->wb_work);
+	truncate_inode_pages_final(&inode->i_data);
+	clear_inode(inode);
+	if (sf_i->mmap_handle)
+		vboxsf_put_handle(sf_i->mmap_handle);
+	vboxsf_fscache_put_inode_cookie(inode);
+	vboxsf_dir_cache_drop(inode);
+	vboxsf_link_drop(inode);
+}
+
 static void vboxsf_free_inode(struct inode *inode)
 {
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(inode->i_sb);
@@ -272,6 +469,10 @@ static void vboxsf_put_super(struct super_block *sb)
 {
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(sb);
 
+	destroy_workqueue(sbi->wq);
+	destroy_workqueue(sbi->wb_wq);
+	destroy_workqueue(sbi->stripe_wq);
+	vboxsf_fscache_put_session_cookie(sbi);
 	vboxsf_unmap_folder(sbi->root);
 	if (sbi->bdi_id >= 0)
 		ida_simple_remove(&vboxsf_bdi_ida, sbi->bdi_id);
@@ -287,20 +488,41 @@ static void vboxsf_put_super(struct super_block *sb)
 	kfree(sbi);
 }
 
+/*
+ * df, monitoring agents and package managers poll statfs constantly, so the
+ * volume info is cached for the statfsttl mount option. For another ttl
+ * period after that the cached info is still returned while it gets
+ * refreshed in the background, only older info is refreshed synchronously.
+ */
 static int vboxsf_statfs(struct dentry *dentry, struct kstatfs *stat)
 {
 	struct super_block *sb = dentry->d_sb;
 	struct shfl_volinfo shfl_volinfo;
+	bool cached = false, stale = false;
 	struct vboxsf_sbi *sbi;
-	u32 buf_len;
+	unsigned long age;
 	int err;
 
 	sbi = VBOXSF_SBI(sb);
-	buf_len = sizeof(shfl_volinfo);
-	err = vboxsf_fsinfo(sbi->root, 0, SHFL_INFO_GET | SHFL_INFO_VOLUME,
-			    &buf_len, &shfl_volinfo);
-	if (err)
-		return err;
+
+	spin_lock(&sbi->volinfo_lock);
+	if (sbi->volinfo_valid) {
+		age = jiffies - sbi->volinfo_time;
+		cached = age < 2 * sbi->o.statfs_ttl;
+		stale = age >= sbi->o.statfs_ttl;
+		if (cached)
+			shfl_volinfo = sbi->volinfo;
+	}
+	spin_unlock(&sbi->volinfo_lock);
+
+	if (!cached) {
+		err = vboxsf_volinfo_refresh(sbi, &shfl_volinfo,
+					     vboxsf_io_sync_meta);
+		if (err)
+			return err;
+	} else if (stale) {
+		queue_work(sbi->wq, &sbi->volinfo_work);
+	}
 
 	stat->f_type = VBOXSF_SUPER_MAGIC;
 	stat->f_bsize = shfl_volinfo.bytes_per_allocation_unit;
@@ -322,15 +544,130 @@ static int vboxsf_statfs(struct dentry *dentry, struct kstatfs *stat)
 	stat->f_ffree = 1000000;
 	stat->f_fsid.val[0] = 0;
 	stat->f_fsid.val[1] = 0;
-	stat->f_namelen = 255;
+	stat->f_namelen = shfl_volinfo.properties.max_component_len ?: 255;
+	return 0;
+}
+
+/*
+ * By the time we get called with wait set, the generic code has already
+ * started writeback of all dirty inodes, which vboxsf_writepages has fanned
+ * out over the per mount workqueue. Ask each inode written to since its
+ * last host flush to also flush its data on the host, these flushes run
+ * concurrently on the workqueue too, and wait for all of them.
+ */
+static int vboxsf_sync_fs(struct super_block *sb, int wait)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(sb);
+	struct inode *inode, *toput_inode = NULL;
+	struct vboxsf_inode *sf_i;
+
+	if (!wait)
+		return 0;
+
+	spin_lock(&sb->s_inode_list_lock);
+	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+		sf_i = VBOXSF_I(inode);
+
+		spin_lock(&inode->i_lock);
+		if ((inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW)) ||
+		    !READ_ONCE(sf_i->needs_flush)) {
+			spin_unlock(&inode->i_lock);
+			continue;
+		}
+		/* Our reference keeps the inode on s_inodes while unlocked */
+		__iget(inode);
+		spin_unlock(&inode->i_lock);
+		spin_unlock(&sb->s_inode_list_lock);
+
+		WRITE_ONCE(sf_i->flush_requested, 1);
+		queue_work(sbi->wb_wq, &sf_i->wb_work);
+
+		iput(toput_inode);
+		toput_inode = inode;
+
+		cond_resched();
+		spin_lock(&sb->s_inode_list_lock);
+	}
+	spin_unlock(&sb->s_inode_list_lock);
+	iput(toput_inode);
+
+	flush_workqueue(sbi->wb_wq);
+	flush_workqueue(sbi->wq);
+	return 0;
+}
+
+static const char * const vboxsf_fn_names[VBOXSF_NR_FNS] = {
+	[SHFL_FN_CREATE]	= "create",
+	[SHFL_FN_CLOSE]		= "close",
+	[SHFL_FN_READ]		= "read",
+	[SHFL_FN_WRITE]		= "write",
+	[SHFL_FN_LIST]		= "list",
+	[SHFL_FN_INFORMATION]	= "information",
+	[SHFL_FN_REMOVE]	= "remove",
+	[SHFL_FN_RENAME]	= "rename",
+	[SHFL_FN_FLUSH]		= "flush",
+	[SHFL_FN_READLINK]	= "readlink",
+	[SHFL_FN_SYMLINK]	= "symlink",
+};
+
+/*
+ * Statistics for /proc/<pid>/mountstats. The counters are per-CPU so that
+ * counting adds no contention to the I/O paths, they get summed up here.
+ * Mounts of the same folder share the host root and with it the counters.
+ *
+ * calls:	per host function: calls errors
+ * bytes:	read written
+ * attrcache:	hits misses (revalidations without / with a host stat)
+ * negdentry:	hits misses (negative dentry revalidations, idem)
+ * listing:	lookups answered from a directory listing
+ * readahead:	windows pages
+ * writeback:	batches pages (one host write per batch)
+ */
+static int vboxsf_show_stats(struct seq_file *m, struct dentry *root)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(root->d_sb);
+	struct vboxsf_stats sum = {};
+	u64 *dst = (u64 *)&sum;
+	const u64 *src;
+	unsigned int i;
+	int cpu;
+
+	BUILD_BUG_ON(sizeof(sum) % sizeof(u64));
+
+	for_each_possible_cpu(cpu) {
+		src = (const u64 *)per_cpu_ptr(sbi->stats, cpu);
+		for (i = 0; i < sizeof(sum) / sizeof(u64); i++)
+			dst[i] += src[i];
+	}
+
+	seq_puts(m, "\n\tstatvers: 1\n\tcalls:");
+	for (i = 0; i < VBOXSF_NR_FNS; i++) {
+		if (vboxsf_fn_names[i])
+			seq_printf(m, "\n\t%12s: %llu %llu", vboxsf_fn_names[i],
+				   sum.calls[i], sum.errors[i]);
+	}
+	seq_printf(m, "\n\tbytes: %llu %llu", sum.bytes_read,
+		   sum.bytes_written);
+	seq_printf(m, "\n\tattrcache: %llu %llu", sum.attr_hits,
+		   sum.attr_misses);
+	seq_printf(m, "\n\tnegdentry: %llu %llu", sum.neg_dentry_hits,
+		   sum.neg_dentry_misses);
+	seq_printf(m, "\n\tlisting: %llu", sum.listing_lookups);
+	seq_printf(m, "\n\treadahead: %llu %llu", sum.readahead_windows,
+		   sum.readahead_pages);
+	seq_printf(m, "\n\twriteback: %llu %llu", sum.wb_batches,
+		   sum.wb_pages);
 	return 0;
 }
 
 static struct super_operations vboxsf_super_ops = {
 	.alloc_inode	= vboxsf_alloc_inode,
+	.evict_inode	= vboxsf_evict_inode,
 	.free_inode	= vboxsf_free_inode,
 	.put_super	= vboxsf_put_super,
+	.sync_fs	= vboxsf_sync_fs,
 	.statfs		= vboxsf_statfs,
+	.show_stats	= vboxsf_show_stats,
 };
 
 static int vboxsf_setup(void)
@@ -353,7 +690,7 @@ static int vboxsf_setup(void)
 		goto fail_nomem;
 	}
 
-	err = vboxsf_connect();
+	err = vboxsf_connect(hgcm_clients ?: num_online_cpus());
 	if (err) {
 		vbg_err("vboxsf: err %d connecting to guest PCI-device\n", err);
 		vbg_err("vboxsf: make sure you are inside a VirtualBox VM\n");
@@ -423,10 +760,25 @@ static int vboxsf_reconfigure(struct fs_context *fc)
 	if (!iroot)
 		return -ENOENT;
 
+	/*
+	 * The fscache session cookie is only acquired at mount time and open
+	 * files may hold deny-write handles, keep these options as mounted.
+	 */
+	ctx->o.fscache = sbi->o.fscache;
+	ctx->o.denywrite = sbi->o.denywrite;
+
 	/* Apply changed options to the root inode */
 	sbi->o = ctx->o;
 	vboxsf_init_inode(sbi, iroot, &sbi->root_info);
 
+	/*
+	 * A remount is the explicit trigger to pick up changes made on the
+	 * host side behind the back of an exclusive mount.
+	 */
+	sbi->inval_time = jiffies;
+	shrink_dcache_sb(fc->root->d_sb);
+	iput(iroot);
+
 	return 0;
 }
 
@@ -455,29 +807,55 @@ static int vboxsf_init_fs_context(struct fs_context *fc)
 		return -ENOMEM;
 
 	current_uid_gid(&ctx->o.uid, &ctx->o.gid);
+	ctx->o.cache = vboxsf_cache_open;
+	ctx->o.stripes = 4;
+	ctx->o.stripe_size = SZ_256K;
+	ctx->o.statfs_ttl = msecs_to_jiffies(1000);
 
 	fc->fs_private = ctx;
 	fc->ops = &vboxsf_context_ops;
 	return 0;
 }
 
+static void vboxsf_kill_sb(struct super_block *sb)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(sb);
+
+	/* Deferred work may hold inode / dentry references, finish it first */
+	if (sbi)
+		flush_workqueue(sbi->wq);
+
+	kill_anon_super(sb);
+}
+
 static struct file_system_type vboxsf_fs_type = {
 	.owner			= THIS_MODULE,
 	.name			= "vboxsf",
 	.init_fs_context	= vboxsf_init_fs_context,
 	.parameters		= &vboxsf_fs_parameters,
-	.kill_sb		= kill_anon_super
+	.kill_sb		= vboxsf_kill_sb
 };
 
 /* Module initialization/finalization handlers */
 static int __init vboxsf_init(void)
 {
-	return register_filesystem(&vboxsf_fs_type);
+	int err;
+
+	err = vboxsf_fscache_register();
+	if (err)
+		return err;
+
+	err = register_filesystem(&vboxsf_fs_type);
+	if (err)
+		vboxsf_fscache_unregister();
+
+	return err;
 }
 
 static void __exit vboxsf_fini(void)
 {
 	unregister_filesystem(&vboxsf_fs_type);
+	vboxsf_fscache_unregister();
 
 	mutex_lock(&vboxsf_setup_mutex);
 	if (vboxsf_setup_done) {
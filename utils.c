@@ -6,12 +6,17 @@
  * Copyright (C) 2006-2018 Oracle Corporation
  */
 
+#include <linux/highmem.h>
 #include <linux/namei.h>
 #include <linux/nls.h>
+#include <linux/pagemap.h>
 #include <linux/sizes.h>
 #include <linux/vfs.h>
 #include "vfsmod.h"
 
+/* Bytes before the old EOF compared to verify that a file was appended to */
+#define VBOXSF_TAIL_SAMPLE_SIZE 64
+
 struct inode *vboxsf_new_inode(struct super_block *sb)
 {
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(sb);
@@ -103,7 +108,13 @@ void vboxsf_init_inode(struct vboxsf_sbi *sbi, struct inode *inode,
 	inode->i_uid = sbi->o.uid;
 	inode->i_gid = sbi->o.gid;
 
-	inode->i_size = info->size;
+	if (attr->additional == SHFLFSOBJATTRADD_UNIX) {
+		VBOXSF_I(inode)->host_inode_id_device =
+					attr->u.unix_attr.inode_id_device;
+		VBOXSF_I(inode)->host_inode_id = attr->u.unix_attr.inode_id;
+	}
+
+	i_size_write(inode, info->size);
 	inode->i_blkbits = 12;
 	/* i_blocks always in units of 512 bytes! */
 	allocated = info->allocated + 511;
@@ -118,8 +129,49 @@ void vboxsf_init_inode(struct vboxsf_sbi *sbi, struct inode *inode,
 			   info->modification_time.ns_relative_to_unix_epoch);
 }
 
+/*
+ * The host resolves full paths, so a create call which got past the parent
+ * directories of @dentry proves that all its ancestors still exist. Push
+ * their d_time forward so that path walks need not revalidate them, see
+ * vboxsf_dentry_revalidate(). If the host could not resolve the parent
+ * directories one of the ancestors is gone, restat them all on next use.
+ */
+static void vboxsf_dentry_prove_path(struct dentry *dentry, u32 result)
+{
+	unsigned long now = jiffies;
+	struct inode *inode;
+	bool found = true;
+
+	switch (result) {
+	case SHFL_NO_RESULT:
+		return;
+	case SHFL_PATH_NOT_FOUND:
+		found = false;
+		break;
+	case SHFL_FILE_NOT_FOUND:
+		break;
+	default:
+		/* Negative dentries use d_time as revalidation cookie */
+		if (d_really_is_positive(dentry))
+			WRITE_ONCE(dentry->d_time, now);
+	}
+
+	rcu_read_lock();
+	while (!IS_ROOT(dentry)) {
+		dentry = READ_ONCE(dentry->d_parent);
+		if (found) {
+			WRITE_ONCE(dentry->d_time, now);
+			continue;
+		}
+		inode = d_inode_rcu(dentry);
+		if (inode)
+			VBOXSF_I(inode)->force_restat = 1;
+	}
+	rcu_read_unlock();
+}
+
 int vboxsf_create_at_dentry(struct dentry *dentry,
-			    struct shfl_createparms *params)
+			    struct shfl_createparms *params, u32 *client_idx)
 {
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
 	struct shfl_string *path;
@@ -129,9 +181,12 @@ int vboxsf_create_at_dentry(struct dentry *dentry,
 	if (IS_ERR(path))
 		return PTR_ERR(path);
 
-	err = vboxsf_create(sbi->root, path, params);
+	err = vboxsf_create(sbi->root, path, params, client_idx);
 	__putname(path);
 
+	if (err == 0)
+		vboxsf_dentry_prove_path(dentry, params->result);
+
 	return err;
 }
 
@@ -144,7 +199,7 @@ int vboxsf_stat(struct vboxsf_sbi *sbi, struct shfl_string *path,
 	params.handle = SHFL_HANDLE_NIL;
 	params.create_flags = SHFL_CF_LOOKUP | SHFL_CF_ACT_FAIL_IF_NEW;
 
-	err = vboxsf_create(sbi->root, path, &params);
+	err = vboxsf_create(sbi->root, path, &params, NULL);
 	if (err)
 		return err;
 
@@ -159,57 +214,341 @@ int vboxsf_stat(struct vboxsf_sbi *sbi, struct shfl_string *path,
 
 int vboxsf_stat_dentry(struct dentry *dentry, struct shfl_fsobjinfo *info)
 {
-	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
-	struct shfl_string *path;
+	struct shfl_createparms params = {};
 	int err;
 
-	path = vboxsf_path_from_dentry(sbi, dentry);
-	if (IS_ERR(path))
-		return PTR_ERR(path);
+	params.handle = SHFL_HANDLE_NIL;
+	params.create_flags = SHFL_CF_LOOKUP | SHFL_CF_ACT_FAIL_IF_NEW;
 
-	err = vboxsf_stat(sbi, path, info);
-	__putname(path);
-	return err;
+	err = vboxsf_create_at_dentry(dentry, &params, NULL);
+	if (err)
+		return err;
+
+	if (params.result != SHFL_FILE_EXISTS)
+		return -ENOENT;
+
+	if (info)
+		*info = params.info;
+
+	return 0;
+}
+
+int vboxsf_stat_handle(struct vboxsf_handle *sf_handle,
+		       struct shfl_fsobjinfo *info)
+{
+	u32 buf_len = sizeof(*info);
+
+	memset(info, 0, sizeof(*info));
+	info->attr.additional = SHFLFSOBJATTRADD_UNIX;
+
+	return vboxsf_fsinfo(sf_handle->root, sf_handle->client_idx,
+			     sf_handle->handle, SHFL_INFO_GET | SHFL_INFO_FILE,
+			     &buf_len, info, vboxsf_io_sync_meta);
+}
+
+/*
+ * Called after each successful host write. The write reply does not tell
+ * us the new host mtime, stating for it after every write would double the
+ * host round trips, so the mtime and size our writes produced are only
+ * recorded at the end of a batch of writes, see vboxsf_record_own_write().
+ */
+void vboxsf_note_own_write(struct inode *inode)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+
+	/* mtime changed */
+	sf_i->force_restat = 1;
+	sf_i->needs_flush = 1;
+	WRITE_ONCE(sf_i->own_write_pending, 1);
+}
+
+/*
+ * Stat @sf_handle to record the host mtime and size after our writes, if
+ * there were any since the last time. The next revalidate compares against
+ * these to tell our own changes from changes made on the host side.
+ */
+void vboxsf_record_own_write(struct inode *inode,
+			     struct vboxsf_handle *sf_handle)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct shfl_fsobjinfo info;
+	int err;
+
+	/* Writes racing with the stat set it again */
+	if (!xchg(&sf_i->own_write_pending, 0))
+		return;
+
+	err = vboxsf_stat_handle(sf_handle, &info);
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	sf_i->own_write = err == 0;
+	sf_i->own_mtime = info.modification_time.ns_relative_to_unix_epoch;
+	sf_i->own_size = info.size;
+	mutex_unlock(&sf_i->handle_list_mutex);
+}
+
+/*
+ * Stat through an open handle if there is one, this avoids building and
+ * resolving the path and works for renamed / unlinked but open files.
+ * Otherwise use a recent listing of the parent directory if @may_list and
+ * there is one, see vboxsf_dir_listing_stat(). Falls back to a path based
+ * stat. *@stat_time is set to when the info was read from the host.
+ */
+static int vboxsf_stat_inode(struct dentry *dentry,
+			     struct shfl_fsobjinfo *info, bool may_list,
+			     unsigned long *stat_time)
+{
+	struct inode *inode = d_inode(dentry);
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct vboxsf_handle *sf_handle;
+	int err;
+
+	if (S_ISREG(inode->i_mode)) {
+		sf_handle = vboxsf_get_handle(sf_i);
+		if (sf_handle) {
+			err = vboxsf_stat_handle(sf_handle, info);
+			vboxsf_put_handle(sf_handle);
+			if (err == 0)
+				goto out_now;
+		}
+	}
+
+	/*
+	 * The listing may predate local changes, only use it if it is newer
+	 * than what we have and we did not change the file since.
+	 */
+	if (may_list && !sf_i->force_restat &&
+	    vboxsf_dir_listing_stat(dentry, info, stat_time) == 0 &&
+	    !time_before(*stat_time, sf_i->attr_time))
+		return 0;
+
+	err = vboxsf_stat_dentry(dentry, info);
+	if (err)
+		return err;
+out_now:
+	*stat_time = jiffies;
+	return 0;
+}
+
+/*
+ * Compare the cached data just before @size with what the host has, this
+ * is used to check that a file which grew has only been appended to.
+ * Returns true only if the data matches, false if it differs or if it cannot
+ * be checked (tail page not cached, no handle open for reading, read error).
+ */
+static bool vboxsf_tail_unchanged(struct inode *inode, loff_t size)
+{
+	pgoff_t index = (size - 1) >> PAGE_SHIFT;
+	struct vboxsf_handle *sf_handle;
+	loff_t start;
+	u32 len, nread;
+	struct page *page;
+	u8 *buf, *cached;
+	bool same = false;
+
+	start = max_t(loff_t, size - VBOXSF_TAIL_SAMPLE_SIZE,
+		      (loff_t)index << PAGE_SHIFT);
+	len = size - start;
+
+	page = find_get_page(inode->i_mapping, index);
+	if (!page)
+		return false;
+
+	if (!PageUptodate(page))
+		goto out_put_page;
+
+	sf_handle = vboxsf_get_read_handle(VBOXSF_I(inode));
+	if (!sf_handle)
+		goto out_put_page;
+
+	buf = kmalloc(VBOXSF_TAIL_SAMPLE_SIZE, GFP_KERNEL);
+	if (!buf)
+		goto out_put_handle;
+
+	nread = len;
+	if (vboxsf_read(sf_handle->root, sf_handle->client_idx,
+			sf_handle->handle, start, &nread, buf,
+			vboxsf_io_sync_meta) == 0) {
+		cached = kmap_atomic(page);
+		same = nread == len &&
+		       memcmp(cached + offset_in_page(start), buf, len) == 0;
+		kunmap_atomic(cached);
+	}
+
+	kfree(buf);
+out_put_handle:
+	vboxsf_put_handle(sf_handle);
+out_put_page:
+	put_page(page);
+	return same;
+}
+
+/*
+ * With the exclusive mount option we are the only one modifying the share,
+ * so cached dentries / inodes stay valid until the user explicitly asks
+ * for a revalidation by remounting, which updates sbi->inval_time.
+ */
+bool vboxsf_exclusive_valid(struct dentry *dentry)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
+
+	return sbi->o.exclusive && !time_before(dentry->d_time,
+						sbi->inval_time);
+}
+
+/* Stat the inode on the host and drop cached data if it has changed */
+static int vboxsf_inode_do_revalidate(struct dentry *dentry)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
+	struct inode *inode = d_inode(dentry);
+	struct vboxsf_inode *sf_i = VBOXSF_I(inode);
+	struct timespec64 prev_mtime = inode->i_mtime;
+	loff_t prev_size = i_size_read(inode);
+	struct shfl_fsobjinfo info;
+	unsigned long stat_time;
+	loff_t host_size, own_size;
+	int err, own_write, pending;
+	s64 own_mtime;
+
+	/*
+	 * Sample the own write record before the stat, a write racing with
+	 * the stat records newer values, which are kept for the next
+	 * revalidate.
+	 */
+	pending = xchg(&sf_i->own_write_pending, 0);
+	mutex_lock(&sf_i->handle_list_mutex);
+	own_write = sf_i->own_write;
+	own_mtime = sf_i->own_mtime;
+	own_size = sf_i->own_size;
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	err = vboxsf_stat_inode(dentry, &info, !own_write && !pending,
+				&stat_time);
+	if (err) {
+		if (pending)
+			WRITE_ONCE(sf_i->own_write_pending, 1);
+		return err;
+	}
+
+	if (own_write) {
+		mutex_lock(&sf_i->handle_list_mutex);
+		if (sf_i->own_mtime == own_mtime && sf_i->own_size == own_size)
+			sf_i->own_write = 0;
+		mutex_unlock(&sf_i->handle_list_mutex);
+	}
+
+	/*
+	 * Writes which have not been recorded yet are still in progress or
+	 * the handle used for them is still open, take the current host
+	 * state as their result.
+	 */
+	if (pending) {
+		own_write = 1;
+		own_mtime = info.modification_time.ns_relative_to_unix_epoch;
+		own_size = info.size;
+	}
+
+	/*
+	 * Data written locally which has not been written back yet is not
+	 * included in the host's size. Do not shrink i_size below it, that
+	 * would hide the data and make writeback drop it. Local truncates
+	 * drop the pages past the new size first, see vboxsf_setattr().
+	 */
+	host_size = info.size;
+	if (host_size < prev_size &&
+	    (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY) ||
+	     mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK)))
+		info.size = prev_size;
+
+	dentry->d_time = stat_time;
+	sf_i->attr_time = stat_time;
+	sf_i->force_restat = 0;
+	vboxsf_init_inode(sbi, inode, &info);
+
+	/*
+	 * If the file was changed on the host side we need to invalidate the
+	 * page-cache for it.  Our own writes move the host mtime too, if
+	 * the host mtime and size are exactly those recorded after our last
+	 * write, see vboxsf_note_own_write(), the change was caused by us.
+	 * With cache=loose we trust the page-cache.
+	 *
+	 * If the file only grew (e.g. a log file being appended to on the
+	 * host) the cached data below the old EOF is still valid, so only
+	 * drop the old last (partial) page and everything after it.
+	 */
+	if (sbi->o.cache != vboxsf_cache_loose &&
+	    timespec64_compare(&inode->i_mtime, &prev_mtime) > 0 &&
+	    !(own_write &&
+	      info.modification_time.ns_relative_to_unix_epoch == own_mtime &&
+	      host_size == own_size)) {
+		if (prev_size > 0 && host_size > prev_size &&
+		    vboxsf_tail_unchanged(inode, prev_size))
+			invalidate_inode_pages2_range(inode->i_mapping,
+						      prev_size >> PAGE_SHIFT,
+						      -1);
+		else
+			invalidate_inode_pages2(inode->i_mapping);
+		vboxsf_fscache_invalidate(inode);
+	}
+
+	return 0;
 }
 
 int vboxsf_inode_revalidate(struct dentry *dentry)
 {
 	struct vboxsf_sbi *sbi;
 	struct vboxsf_inode *sf_i;
-	struct shfl_fsobjinfo info;
-	struct timespec64 prev_mtime;
 	struct inode *inode;
+	unsigned long gen;
 	int err;
 
 	if (!dentry || !d_really_is_positive(dentry))
 		return -EINVAL;
 
 	inode = d_inode(dentry);
-	prev_mtime = inode->i_mtime;
 	sf_i = VBOXSF_I(inode);
 	sbi = VBOXSF_SBI(dentry->d_sb);
+	/*
+	 * Files we have open with a host granted DENYWRITE cannot change
+	 * underneath us, see vboxsf_want_deny_write(). The attribute age is
+	 * tracked in the inode, d_time also gets refreshed by operations on
+	 * descendants which only prove that the dentry still exists.
+	 */
 	if (!sf_i->force_restat) {
-		if (time_before(jiffies, dentry->d_time + sbi->o.ttl))
+		if ((sbi->o.exclusive &&
+		     !time_before(sf_i->attr_time, sbi->inval_time)) ||
+		    READ_ONCE(sf_i->deny_write_count) ||
+		    time_before(jiffies, sf_i->attr_time + sbi->o.ttl)) {
+			vboxsf_stats_inc(sbi, attr_hits);
 			return 0;
+		}
 	}
 
-	err = vboxsf_stat_dentry(dentry, &info);
-	if (err)
-		return err;
-
-	dentry->d_time = jiffies;
-	sf_i->force_restat = 0;
-	vboxsf_init_inode(sbi, inode, &info);
-
 	/*
-	 * If the file was changed on the host side we need to invalidate the
-	 * page-cache for it.  Note this also gets triggered by our own writes,
-	 * this is unavoidable.
+	 * Singleflight: when many tasks revalidate the same inode at once,
+	 * e.g. at the start of a parallel build, only one of them does the
+	 * stat and the others wait for it and share its result. Forced
+	 * restats do not share the result of a stat which may have started
+	 * before the change they are waiting for.
 	 */
-	if (timespec64_compare(&inode->i_mtime, &prev_mtime) > 0)
-		invalidate_inode_pages2(inode->i_mapping);
+	gen = READ_ONCE(sf_i->stat_gen);
 
-	return 0;
+	mutex_lock(&sf_i->stat_mutex);
+
+	if (sf_i->stat_gen != gen && !sf_i->force_restat) {
+		vboxsf_stats_inc(sbi, attr_hits);
+		err = sf_i->stat_err;
+		if (err == 0)
+			dentry->d_time = jiffies;
+	} else {
+		vboxsf_stats_inc(sbi, attr_misses);
+		err = vboxsf_inode_do_revalidate(dentry);
+		sf_i->stat_err = err;
+		WRITE_ONCE(sf_i->stat_gen, sf_i->stat_gen + 1);
+	}
+
+	mutex_unlock(&sf_i->stat_mutex);
+	return err;
 }
 
 int vboxsf_getattr(const struct path *path, struct kstat *kstat,
@@ -243,7 +582,7 @@ int vboxsf_setattr(struct dentry *dentry, struct iattr *iattr)
 	struct vboxsf_sbi *sbi = VBOXSF_SBI(dentry->d_sb);
 	struct shfl_createparms params = {};
 	struct shfl_fsobjinfo info = {};
-	u32 buf_len;
+	u32 buf_len, client_idx;
 	int err;
 
 	params.handle = SHFL_HANDLE_NIL;
@@ -255,7 +594,7 @@ int vboxsf_setattr(struct dentry *dentry, struct iattr *iattr)
 	if (iattr->ia_valid & ATTR_SIZE)
 		params.create_flags |= SHFL_CF_ACCESS_WRITE;
 
-	err = vboxsf_create_at_dentry(dentry, &params);
+	err = vboxsf_create_at_dentry(dentry, &params, &client_idx);
 	if (err || params.result != SHFL_FILE_EXISTS)
 		return err ? err : -ENOENT;
 
@@ -297,11 +636,11 @@ int vboxsf_setattr(struct dentry *dentry, struct iattr *iattr)
 		 */
 
 		buf_len = sizeof(info);
-		err = vboxsf_fsinfo(sbi->root, params.handle,
+		err = vboxsf_fsinfo(sbi->root, client_idx, params.handle,
 				    SHFL_INFO_SET | SHFL_INFO_FILE, &buf_len,
-				    &info);
+				    &info, vboxsf_io_sync_meta);
 		if (err) {
-			vboxsf_close(sbi->root, params.handle);
+			vboxsf_close(sbi->root, client_idx, params.handle);
 			return err;
 		}
 
@@ -312,22 +651,31 @@ int vboxsf_setattr(struct dentry *dentry, struct iattr *iattr)
 #undef mode_set
 
 	if (iattr->ia_valid & ATTR_SIZE) {
+		/* Let asynchronous writes finish first */
+		inode_dio_wait(d_inode(dentry));
+
 		memset(&info, 0, sizeof(info));
 		info.size = iattr->ia_size;
 		buf_len = sizeof(info);
-		err = vboxsf_fsinfo(sbi->root, params.handle,
+		err = vboxsf_fsinfo(sbi->root, client_idx, params.handle,
 				    SHFL_INFO_SET | SHFL_INFO_SIZE, &buf_len,
-				    &info);
+				    &info, vboxsf_io_sync_meta);
 		if (err) {
-			vboxsf_close(sbi->root, params.handle);
+			vboxsf_close(sbi->root, client_idx, params.handle);
 			return err;
 		}
 
+		/*
+		 * Drop the cached pages past the new size, so that neither
+		 * the restat below nor writeback brings their data back.
+		 */
+		truncate_setsize(d_inode(dentry), iattr->ia_size);
+
 		/* the host may have given us different attr then requested */
 		sf_i->force_restat = 1;
 	}
 
-	vboxsf_close(sbi->root, params.handle);
+	vboxsf_close(sbi->root, client_idx, params.handle);
 
 	/* Update the inode with what the host has actually given us. */
 	if (sf_i->force_restat)
@@ -494,6 +842,10 @@ struct vboxsf_dir_info *vboxsf_dir_info_alloc(void)
 		return NULL;
 
 	INIT_LIST_HEAD(&p->info_list);
+	kref_init(&p->refcount);
+	p->read_time = jiffies;
+	p->index = NULL;
+	p->index_mask = 0;
 	return p;
 }
 
@@ -508,11 +860,87 @@ void vboxsf_dir_info_free(struct vboxsf_dir_info *p)
 		b = list_entry(pos, struct vboxsf_dir_buf, head);
 		vboxsf_dir_buf_free(b);
 	}
+	kvfree(p->index);
 	kfree(p);
 }
 
+static void vboxsf_dir_info_release(struct kref *refcount)
+{
+	vboxsf_dir_info_free(container_of(refcount, struct vboxsf_dir_info,
+					  refcount));
+}
+
+void vboxsf_dir_info_put(struct vboxsf_dir_info *p)
+{
+	kref_put(&p->refcount, vboxsf_dir_info_release);
+}
+
+/*
+ * Returns a reference to the directory listing cached on the inode by
+ * exclusive mounts, or NULL if there is none or it predates the last
+ * explicit invalidation.
+ */
+struct vboxsf_dir_info *vboxsf_dir_cache_get(struct inode *dir)
+{
+	struct vboxsf_sbi *sbi = VBOXSF_SBI(dir->i_sb);
+	struct vboxsf_inode *sf_i = VBOXSF_I(dir);
+	struct vboxsf_dir_info *p, *stale = NULL;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	p = sf_i->dir_cache;
+	if (p && time_before(p->read_time, sbi->inval_time)) {
+		stale = p;
+		sf_i->dir_cache = p = NULL;
+	}
+	if (p)
+		kref_get(&p->refcount);
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (stale)
+		vboxsf_dir_info_put(stale);
+
+	return p;
+}
+
+void vboxsf_dir_cache_set(struct inode *dir, struct vboxsf_dir_info *p)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(dir);
+	struct vboxsf_dir_info *old;
+
+	kref_get(&p->refcount);
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	old = sf_i->dir_cache;
+	sf_i->dir_cache = p;
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (old)
+		vboxsf_dir_info_put(old);
+}
+
+/* Called when we change the directory's contents */
+void vboxsf_dir_cache_drop(struct inode *dir)
+{
+	struct vboxsf_inode *sf_i = VBOXSF_I(dir);
+	struct vboxsf_dir_info *old, *old_lookup;
+
+	mutex_lock(&sf_i->handle_list_mutex);
+	old = sf_i->dir_cache;
+	sf_i->dir_cache = NULL;
+	old_lookup = sf_i->lookup_dir;
+	sf_i->lookup_dir = NULL;
+	sf_i->lookup_gen++;
+	mutex_unlock(&sf_i->handle_list_mutex);
+
+	if (old)
+		vboxsf_dir_info_put(old);
+	if (old_lookup)
+		vboxsf_dir_info_put(old_lookup);
+}
+
 int vboxsf_dir_read_all(struct vboxsf_sbi *sbi, struct vboxsf_dir_info *sf_d,
-			u64 handle)
+			u32 client_idx, u64 handle,
+			enum vboxsf_io_class class)
 {
 	struct vboxsf_dir_buf *b;
 	u32 entries, size;
@@ -530,8 +958,8 @@ int vboxsf_dir_read_all(struct vboxsf_sbi *sbi, struct vboxsf_dir_info *sf_d,
 		buf = b->buf;
 		size = b->free;
 
-		err = vboxsf_dirinfo(sbi->root, handle, NULL, 0, 0,
-				     &size, buf, &entries);
+		err = vboxsf_dirinfo(sbi->root, client_idx, handle, NULL, 0, 0,
+				     &size, buf, &entries, class);
 		if (err < 0)
 			break;
 
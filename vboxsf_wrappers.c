@@ -5,6 +5,8 @@
  * Copyright (C) 2006-2018 Oracle Corporation
  */
 
+#include <linux/completion.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/vbox_err.h>
@@ -15,13 +17,45 @@
 	(VMMDEV_REQUESTOR_KERNEL | VMMDEV_REQUESTOR_USR_DRV_OTHER | \
 	 VMMDEV_REQUESTOR_CON_DONT_KNOW | VMMDEV_REQUESTOR_TRUST_NOT_GIVEN)
 
-static u32 vboxsf_client_id;
+/*
+ * We use a pool of HGCM client connections, so that concurrent requests do
+ * not all get serialized on a single client on the host side. Requests
+ * which are not bound to a handle go to the client of the current CPU, or
+ * to the least busy client if that one is busy.
+ *
+ * Roots from SHFL_FN_MAP_FOLDER and handles from SHFL_FN_CREATE are only
+ * valid on the client they were obtained from. Folders get mapped on every
+ * client, the rest of vboxsf uses the root of the first client and the
+ * roots for the other clients are looked up in vboxsf_roots. vboxsf_create
+ * returns the index of the client a handle belongs to, callers pass it back
+ * together with the handle.
+ */
+
+struct vboxsf_client {
+	u32 id;
+	atomic_t busy;
+};
+
+static struct vboxsf_client vboxsf_clients[VBOXSF_MAX_CLIENTS];
+static unsigned int vboxsf_nr_clients;
+static u32 vboxsf_roots[SHFL_MAX_MAPPINGS][VBOXSF_MAX_CLIENTS];
+
+/*
+ * Per root statistics. The host hands out the same root when a folder gets
+ * mapped more than once, so these are refcounted by the number of mappings.
+ */
+static struct vboxsf_stats __percpu *vboxsf_stats[SHFL_MAX_MAPPINGS];
+static unsigned int vboxsf_stats_users[SHFL_MAX_MAPPINGS];
+static DEFINE_MUTEX(vboxsf_stats_mutex);
 
-int vboxsf_connect(void)
+static void vboxsf_sched_init(void);
+
+int vboxsf_connect(unsigned int nr_clients)
 {
 	struct vbg_dev *gdev;
 	struct vmmdev_hgcm_service_location loc;
-	int err, vbox_status;
+	int err = 0, vbox_status;
+	unsigned int i;
 
 	loc.type = VMMDEV_HGCM_LOC_LOCALHOST_EXISTING;
 	strcpy(loc.u.localhost.service_name, "VBoxSharedFolders");
@@ -30,27 +64,224 @@ int vboxsf_connect(void)
 	if (IS_ERR(gdev))
 		return -ENODEV;	/* No guest-device */
 
-	err = vbg_hgcm_connect(gdev, SHFL_REQUEST, &loc,
-			       &vboxsf_client_id, &vbox_status);
+	vboxsf_sched_init();
+
+	nr_clients = clamp(nr_clients, 1U, (unsigned int)VBOXSF_MAX_CLIENTS);
+	for (i = 0; i < nr_clients; i++) {
+		err = vbg_hgcm_connect(gdev, SHFL_REQUEST, &loc,
+				       &vboxsf_clients[i].id, &vbox_status);
+		if (err == 0)
+			err = vbg_status_code_to_errno(vbox_status);
+		if (err)
+			break;
+
+		atomic_set(&vboxsf_clients[i].busy, 0);
+		vboxsf_nr_clients++;
+	}
 	vbg_put_gdev(gdev);
 
-	return err ? err : vbg_status_code_to_errno(vbox_status);
+	/* The host may limit the number of clients, fewer is fine */
+	if (vboxsf_nr_clients && err)
+		vbg_warn("vboxsf: only got %u of %u HGCM clients: %d\n",
+			 vboxsf_nr_clients, nr_clients, err);
+
+	return vboxsf_nr_clients ? 0 : err;
 }
 
 void vboxsf_disconnect(void)
 {
 	struct vbg_dev *gdev;
 	int vbox_status;
+	unsigned int i;
 
 	gdev = vbg_get_gdev();
 	if (IS_ERR(gdev))
 		return;   /* guest-device is gone, already disconnected */
 
-	vbg_hgcm_disconnect(gdev, SHFL_REQUEST, vboxsf_client_id, &vbox_status);
+	for (i = 0; i < vboxsf_nr_clients; i++)
+		vbg_hgcm_disconnect(gdev, SHFL_REQUEST, vboxsf_clients[i].id,
+				    &vbox_status);
+	vboxsf_nr_clients = 0;
 	vbg_put_gdev(gdev);
 }
 
-static int vboxsf_call(u32 function, void *parms, u32 parm_count, int *status)
+static struct vboxsf_client *vboxsf_pick_client(void)
+{
+	struct vboxsf_client *client, *best;
+	unsigned int i, busy;
+
+	best = &vboxsf_clients[raw_smp_processor_id() % vboxsf_nr_clients];
+	busy = atomic_read(&best->busy);
+
+	for (i = 0; busy && i < vboxsf_nr_clients; i++) {
+		client = &vboxsf_clients[i];
+		if (atomic_read(&client->busy) < busy) {
+			best = client;
+			busy = atomic_read(&client->busy);
+		}
+	}
+
+	return best;
+}
+
+static u32 vboxsf_client_root(struct vboxsf_client *client, u32 root)
+{
+	return vboxsf_roots[root][client - vboxsf_clients];
+}
+
+/*
+ * Per share request scheduler. Metadata calls somebody is waiting for are
+ * never held back. All other calls are limited to sched->limit calls in
+ * flight per share, when a slot frees up the waiting call of the highest
+ * class gets it.
+ *
+ * The limit is adjusted AIMD style based on the latency of the metadata
+ * calls: if it rises well above the lowest latency seen recently, then the
+ * host is queueing metadata calls behind our data calls and the limit gets
+ * halved, otherwise the limit grows by one each time limit data calls have
+ * completed.
+ */
+#define VBOXSF_SCHED_MIN_LIMIT		2
+#define VBOXSF_SCHED_INIT_LIMIT		16
+#define VBOXSF_SCHED_MAX_LIMIT		64
+#define VBOXSF_SCHED_SLACK_NS		NSEC_PER_MSEC
+#define VBOXSF_SCHED_BASELINE_TTL	(10 * HZ)
+#define VBOXSF_SCHED_DECREASE_INTERVAL	(HZ / 10)
+
+struct vboxsf_sched {
+	spinlock_t lock;
+	struct list_head waiters[vboxsf_io_nr_classes];
+	unsigned int inflight;
+	unsigned int limit;
+	unsigned int grow;
+	u64 min_lat;
+	unsigned long min_lat_time;
+	unsigned long decrease_time;
+};
+
+struct vboxsf_sched_waiter {
+	struct list_head head;
+	struct completion done;
+};
+
+/* Indexed by the (client 0) root, so shared by all mounts of a share */
+static struct vboxsf_sched vboxsf_scheds[SHFL_MAX_MAPPINGS];
+
+static void vboxsf_sched_init(void)
+{
+	struct vboxsf_sched *sched;
+	int i, j;
+
+	for (i = 0; i < SHFL_MAX_MAPPINGS; i++) {
+		sched = &vboxsf_scheds[i];
+		spin_lock_init(&sched->lock);
+		for (j = 0; j < vboxsf_io_nr_classes; j++)
+			INIT_LIST_HEAD(&sched->waiters[j]);
+		sched->limit = VBOXSF_SCHED_INIT_LIMIT;
+		sched->min_lat_time = jiffies;
+		sched->decrease_time = jiffies;
+	}
+}
+
+/* Must be called with sched->lock held */
+static void vboxsf_sched_wake(struct vboxsf_sched *sched)
+{
+	struct vboxsf_sched_waiter *w;
+	int i;
+
+	for (i = 0; i < vboxsf_io_nr_classes; i++) {
+		while (sched->inflight < sched->limit &&
+		       !list_empty(&sched->waiters[i])) {
+			w = list_first_entry(&sched->waiters[i],
+					     struct vboxsf_sched_waiter, head);
+			list_del(&w->head);
+			sched->inflight++;
+			complete(&w->done);
+		}
+	}
+}
+
+static void vboxsf_sched_begin(struct vboxsf_sched *sched,
+			       enum vboxsf_io_class class)
+{
+	struct vboxsf_sched_waiter w;
+	int i;
+
+	spin_lock(&sched->lock);
+
+	if (class == vboxsf_io_sync_meta)
+		goto start;
+
+	/* Do not overtake waiting calls of the same or a higher class */
+	if (sched->inflight < sched->limit) {
+		for (i = 0; i <= class; i++) {
+			if (!list_empty(&sched->waiters[i]))
+				break;
+		}
+		if (i > class)
+			goto start;
+	}
+
+	init_completion(&w.done);
+	list_add_tail(&w.head, &sched->waiters[class]);
+	spin_unlock(&sched->lock);
+
+	/* vboxsf_sched_wake() accounts the call as in flight for us */
+	wait_for_completion(&w.done);
+	return;
+
+start:
+	sched->inflight++;
+	spin_unlock(&sched->lock);
+}
+
+/* Must be called with sched->lock held, lat is the metadata call latency */
+static void vboxsf_sched_adjust(struct vboxsf_sched *sched, u64 lat)
+{
+	unsigned long baseline_expire, decrease_after;
+
+	baseline_expire = sched->min_lat_time + VBOXSF_SCHED_BASELINE_TTL;
+	decrease_after = sched->decrease_time + VBOXSF_SCHED_DECREASE_INTERVAL;
+
+	if (!sched->min_lat || lat < sched->min_lat ||
+	    time_after(jiffies, baseline_expire)) {
+		sched->min_lat = lat;
+		sched->min_lat_time = jiffies;
+		return;
+	}
+
+	if (lat <= max(2 * sched->min_lat,
+		       sched->min_lat + VBOXSF_SCHED_SLACK_NS) ||
+	    !time_after(jiffies, decrease_after))
+		return;
+
+	sched->limit = max(sched->limit / 2,
+			   (unsigned int)VBOXSF_SCHED_MIN_LIMIT);
+	sched->grow = 0;
+	sched->decrease_time = jiffies;
+}
+
+static void vboxsf_sched_end(struct vboxsf_sched *sched,
+			     enum vboxsf_io_class class, u64 lat)
+{
+	spin_lock(&sched->lock);
+
+	sched->inflight--;
+
+	if (class == vboxsf_io_sync_meta) {
+		vboxsf_sched_adjust(sched, lat);
+	} else if (++sched->grow >= sched->limit) {
+		sched->grow = 0;
+		if (sched->limit < VBOXSF_SCHED_MAX_LIMIT)
+			sched->limit++;
+	}
+
+	vboxsf_sched_wake(sched);
+	spin_unlock(&sched->lock);
+}
+
+static int vboxsf_call(struct vboxsf_client *client, u32 function,
+		       void *parms, u32 parm_count, int *status)
 {
 	struct vbg_dev *gdev;
 	int err, vbox_status;
@@ -59,8 +290,10 @@ static int vboxsf_call(u32 function, void *parms, u32 parm_count, int *status)
 	if (IS_ERR(gdev))
 		return -ESHUTDOWN; /* guest-dev removed underneath us */
 
-	err = vbg_hgcm_call(gdev, SHFL_REQUEST, vboxsf_client_id, function,
+	atomic_inc(&client->busy);
+	err = vbg_hgcm_call(gdev, SHFL_REQUEST, client->id, function,
 			    U32_MAX, parms, parm_count, &vbox_status);
+	atomic_dec(&client->busy);
 	vbg_put_gdev(gdev);
 
 	if (err < 0)
@@ -72,7 +305,29 @@ static int vboxsf_call(u32 function, void *parms, u32 parm_count, int *status)
 	return vbg_status_code_to_errno(vbox_status);
 }
 
-int vboxsf_map_folder(struct shfl_string *folder_name, u32 *root)
+static int vboxsf_sched_call(struct vboxsf_client *client, u32 root,
+			     enum vboxsf_io_class class, u32 function,
+			     void *parms, u32 parm_count, int *status)
+{
+	struct vboxsf_stats __percpu *stats = vboxsf_stats[root];
+	struct vboxsf_sched *sched = &vboxsf_scheds[root];
+	u64 start;
+	int err;
+
+	vboxsf_sched_begin(sched, class);
+	start = ktime_get_ns();
+	err = vboxsf_call(client, function, parms, parm_count, status);
+	vboxsf_sched_end(sched, class, ktime_get_ns() - start);
+
+	this_cpu_inc(stats->calls[function]);
+	if (err)
+		this_cpu_inc(stats->errors[function]);
+
+	return err;
+}
+
+static int vboxsf_map_folder_client(struct vboxsf_client *client,
+				    struct shfl_string *folder_name, u32 *root)
 {
 	struct shfl_map_folder parms;
 	int err, status;
@@ -90,8 +345,8 @@ int vboxsf_map_folder(struct shfl_string *folder_name, u32 *root)
 	parms.case_sensitive.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
 	parms.case_sensitive.u.value32 = 1;
 
-	err = vboxsf_call(SHFL_FN_MAP_FOLDER, &parms, SHFL_CPARMS_MAP_FOLDER,
-			  &status);
+	err = vboxsf_call(client, SHFL_FN_MAP_FOLDER, &parms,
+			  SHFL_CPARMS_MAP_FOLDER, &status);
 	if (err == -ENOSYS && status == VERR_NOT_IMPLEMENTED)
 		vbg_err("%s: Error host is too old\n", __func__);
 
@@ -99,22 +354,94 @@ int vboxsf_map_folder(struct shfl_string *folder_name, u32 *root)
 	return err;
 }
 
-int vboxsf_unmap_folder(u32 root)
+static int vboxsf_unmap_folder_client(struct vboxsf_client *client, u32 root)
 {
 	struct shfl_unmap_folder parms;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
 	parms.root.u.value32 = root;
 
-	return vboxsf_call(SHFL_FN_UNMAP_FOLDER, &parms,
+	return vboxsf_call(client, SHFL_FN_UNMAP_FOLDER, &parms,
 			   SHFL_CPARMS_UNMAP_FOLDER, NULL);
 }
 
+/*
+ * Map the folder on all clients. Mapping an already mapped folder gives the
+ * same roots again (the host refcounts the mappings), so the vboxsf_roots
+ * entry simply gets rewritten with the same values.
+ */
+int vboxsf_map_folder(struct shfl_string *folder_name, u32 *root)
+{
+	struct vboxsf_stats __percpu **stats;
+	u32 roots[VBOXSF_MAX_CLIENTS];
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < vboxsf_nr_clients; i++) {
+		err = vboxsf_map_folder_client(&vboxsf_clients[i], folder_name,
+					       &roots[i]);
+		if (err)
+			break;
+	}
+
+	if (err == 0 && roots[0] >= SHFL_MAX_MAPPINGS)
+		err = -EINVAL;
+
+	if (err == 0) {
+		stats = &vboxsf_stats[roots[0]];
+		mutex_lock(&vboxsf_stats_mutex);
+		if (vboxsf_stats_users[roots[0]] == 0)
+			*stats = alloc_percpu(struct vboxsf_stats);
+		if (*stats)
+			vboxsf_stats_users[roots[0]]++;
+		else
+			err = -ENOMEM;
+		mutex_unlock(&vboxsf_stats_mutex);
+	}
+
+	if (err) {
+		while (i--)
+			vboxsf_unmap_folder_client(&vboxsf_clients[i],
+						   roots[i]);
+		return err;
+	}
+
+	memcpy(vboxsf_roots[roots[0]], roots, vboxsf_nr_clients * sizeof(u32));
+	*root = roots[0];
+	return 0;
+}
+
+int vboxsf_unmap_folder(u32 root)
+{
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < vboxsf_nr_clients; i++)
+		err = vboxsf_unmap_folder_client(&vboxsf_clients[i],
+						 vboxsf_roots[root][i]);
+
+	mutex_lock(&vboxsf_stats_mutex);
+	if (--vboxsf_stats_users[root] == 0) {
+		free_percpu(vboxsf_stats[root]);
+		vboxsf_stats[root] = NULL;
+	}
+	mutex_unlock(&vboxsf_stats_mutex);
+
+	return err;
+}
+
+struct vboxsf_stats __percpu *vboxsf_root_stats(u32 root)
+{
+	return vboxsf_stats[root];
+}
+
 /**
  * vboxsf_create - Create a new file or folder
  * @root:         Root of the shared folder in which to create the file
  * @parsed_path:  The path of the file or folder relative to the shared folder
  * @param:        create_parms Parameters for file/folder creation.
+ * @client_idx:   Set to the client the handle belongs to, may be NULL if
+ *                no handle is opened (SHFL_CF_LOOKUP).
  *
  * Create a new file or folder or open an existing one in a shared folder.
  * Note this function always returns 0 / success unless an exceptional condition
@@ -128,12 +455,14 @@ int vboxsf_unmap_folder(u32 root)
  * 0 or negative errno value.
  */
 int vboxsf_create(u32 root, struct shfl_string *parsed_path,
-		  struct shfl_createparms *create_parms)
+		  struct shfl_createparms *create_parms, u32 *client_idx)
 {
+	struct vboxsf_client *client = vboxsf_pick_client();
 	struct shfl_create parms;
+	int err;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.path.type = VMMDEV_HGCM_PARM_TYPE_LINADDR_KERNEL;
 	parms.path.u.pointer.size = shfl_string_buf_size(parsed_path);
@@ -143,28 +472,40 @@ int vboxsf_create(u32 root, struct shfl_string *parsed_path,
 	parms.parms.u.pointer.size = sizeof(struct shfl_createparms);
 	parms.parms.u.pointer.u.linear_addr = (uintptr_t)create_parms;
 
-	return vboxsf_call(SHFL_FN_CREATE, &parms, SHFL_CPARMS_CREATE, NULL);
+	err = vboxsf_sched_call(client, root, vboxsf_io_sync_meta,
+				SHFL_FN_CREATE, &parms, SHFL_CPARMS_CREATE,
+				NULL);
+
+	/* Later calls on the handle must go to the same client */
+	if (client_idx)
+		*client_idx = client - vboxsf_clients;
+
+	return err;
 }
 
-int vboxsf_close(u32 root, u64 handle)
+int vboxsf_close(u32 root, u32 client_idx, u64 handle)
 {
+	struct vboxsf_client *client = &vboxsf_clients[client_idx];
 	struct shfl_close parms;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.handle.type = VMMDEV_HGCM_PARM_TYPE_64BIT;
 	parms.handle.u.value64 = handle;
 
-	return vboxsf_call(SHFL_FN_CLOSE, &parms, SHFL_CPARMS_CLOSE, NULL);
+	return vboxsf_sched_call(client, root, vboxsf_io_sync_meta,
+				 SHFL_FN_CLOSE, &parms, SHFL_CPARMS_CLOSE,
+				 NULL);
 }
 
 int vboxsf_remove(u32 root, struct shfl_string *parsed_path, u32 flags)
 {
+	struct vboxsf_client *client = vboxsf_pick_client();
 	struct shfl_remove parms;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.path.type = VMMDEV_HGCM_PARM_TYPE_LINADDR_KERNEL_IN;
 	parms.path.u.pointer.size = shfl_string_buf_size(parsed_path);
@@ -173,16 +514,19 @@ int vboxsf_remove(u32 root, struct shfl_string *parsed_path, u32 flags)
 	parms.flags.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
 	parms.flags.u.value32 = flags;
 
-	return vboxsf_call(SHFL_FN_REMOVE, &parms, SHFL_CPARMS_REMOVE, NULL);
+	return vboxsf_sched_call(client, root, vboxsf_io_sync_meta,
+				 SHFL_FN_REMOVE, &parms, SHFL_CPARMS_REMOVE,
+				 NULL);
 }
 
 int vboxsf_rename(u32 root, struct shfl_string *src_path,
 		  struct shfl_string *dest_path, u32 flags)
 {
+	struct vboxsf_client *client = vboxsf_pick_client();
 	struct shfl_rename parms;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.src.type = VMMDEV_HGCM_PARM_TYPE_LINADDR_KERNEL_IN;
 	parms.src.u.pointer.size = shfl_string_buf_size(src_path);
@@ -195,16 +539,20 @@ int vboxsf_rename(u32 root, struct shfl_string *src_path,
 	parms.flags.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
 	parms.flags.u.value32 = flags;
 
-	return vboxsf_call(SHFL_FN_RENAME, &parms, SHFL_CPARMS_RENAME, NULL);
+	return vboxsf_sched_call(client, root, vboxsf_io_sync_meta,
+				 SHFL_FN_RENAME, &parms, SHFL_CPARMS_RENAME,
+				 NULL);
 }
 
-int vboxsf_read(u32 root, u64 handle, u64 offset, u32 *buf_len, u8 *buf)
+int vboxsf_read(u32 root, u32 client_idx, u64 handle, u64 offset,
+		u32 *buf_len, u8 *buf, enum vboxsf_io_class class)
 {
+	struct vboxsf_client *client = &vboxsf_clients[client_idx];
 	struct shfl_read parms;
 	int err;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.handle.type = VMMDEV_HGCM_PARM_TYPE_64BIT;
 	parms.handle.u.value64 = handle;
@@ -216,19 +564,24 @@ int vboxsf_read(u32 root, u64 handle, u64 offset, u32 *buf_len, u8 *buf)
 	parms.buffer.u.pointer.size = *buf_len;
 	parms.buffer.u.pointer.u.linear_addr = (uintptr_t)buf;
 
-	err = vboxsf_call(SHFL_FN_READ, &parms, SHFL_CPARMS_READ, NULL);
+	err = vboxsf_sched_call(client, root, class, SHFL_FN_READ, &parms,
+				SHFL_CPARMS_READ, NULL);
 
 	*buf_len = parms.cb.u.value32;
+	if (err == 0)
+		this_cpu_add(vboxsf_stats[root]->bytes_read, *buf_len);
 	return err;
 }
 
-int vboxsf_write(u32 root, u64 handle, u64 offset, u32 *buf_len, u8 *buf)
+int vboxsf_write(u32 root, u32 client_idx, u64 handle, u64 offset,
+		 u32 *buf_len, u8 *buf, enum vboxsf_io_class class)
 {
+	struct vboxsf_client *client = &vboxsf_clients[client_idx];
 	struct shfl_write parms;
 	int err;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.handle.type = VMMDEV_HGCM_PARM_TYPE_64BIT;
 	parms.handle.u.value64 = handle;
@@ -240,22 +593,43 @@ int vboxsf_write(u32 root, u64 handle, u64 offset, u32 *buf_len, u8 *buf)
 	parms.buffer.u.pointer.size = *buf_len;
 	parms.buffer.u.pointer.u.linear_addr = (uintptr_t)buf;
 
-	err = vboxsf_call(SHFL_FN_WRITE, &parms, SHFL_CPARMS_WRITE, NULL);
+	err = vboxsf_sched_call(client, root, class, SHFL_FN_WRITE, &parms,
+				SHFL_CPARMS_WRITE, NULL);
 
 	*buf_len = parms.cb.u.value32;
+	if (err == 0)
+		this_cpu_add(vboxsf_stats[root]->bytes_written, *buf_len);
 	return err;
 }
 
+int vboxsf_flush(u32 root, u32 client_idx, u64 handle)
+{
+	struct vboxsf_client *client = &vboxsf_clients[client_idx];
+	struct shfl_flush parms;
+
+	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
+
+	parms.handle.type = VMMDEV_HGCM_PARM_TYPE_64BIT;
+	parms.handle.u.value64 = handle;
+
+	return vboxsf_sched_call(client, root, vboxsf_io_sync_data,
+				 SHFL_FN_FLUSH, &parms, SHFL_CPARMS_FLUSH,
+				 NULL);
+}
+
 /* Returns 0 on success, 1 on end-of-dir, negative errno otherwise */
-int vboxsf_dirinfo(u32 root, u64 handle,
+int vboxsf_dirinfo(u32 root, u32 client_idx, u64 handle,
 		   struct shfl_string *parsed_path, u32 flags, u32 index,
-		   u32 *buf_len, struct shfl_dirinfo *buf, u32 *file_count)
+		   u32 *buf_len, struct shfl_dirinfo *buf, u32 *file_count,
+		   enum vboxsf_io_class class)
 {
+	struct vboxsf_client *client = &vboxsf_clients[client_idx];
 	struct shfl_list parms;
 	int err, status;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.handle.type = VMMDEV_HGCM_PARM_TYPE_64BIT;
 	parms.handle.u.value64 = handle;
@@ -282,7 +656,8 @@ int vboxsf_dirinfo(u32 root, u64 handle,
 	parms.file_count.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
 	parms.file_count.u.value32 = 0;	/* out parameter only */
 
-	err = vboxsf_call(SHFL_FN_LIST, &parms, SHFL_CPARMS_LIST, &status);
+	err = vboxsf_sched_call(client, root, class, SHFL_FN_LIST, &parms,
+				SHFL_CPARMS_LIST, &status);
 	if (err == -ENODATA && status == VERR_NO_MORE_FILES)
 		err = 1;
 
@@ -291,14 +666,15 @@ int vboxsf_dirinfo(u32 root, u64 handle,
 	return err;
 }
 
-int vboxsf_fsinfo(u32 root, u64 handle, u32 flags,
-		  u32 *buf_len, void *buf)
+int vboxsf_fsinfo(u32 root, u32 client_idx, u64 handle, u32 flags,
+		  u32 *buf_len, void *buf, enum vboxsf_io_class class)
 {
+	struct vboxsf_client *client = &vboxsf_clients[client_idx];
 	struct shfl_information parms;
 	int err;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.handle.type = VMMDEV_HGCM_PARM_TYPE_64BIT;
 	parms.handle.u.value64 = handle;
@@ -310,8 +686,8 @@ int vboxsf_fsinfo(u32 root, u64 handle, u32 flags,
 	parms.info.u.pointer.size = *buf_len;
 	parms.info.u.pointer.u.linear_addr = (uintptr_t)buf;
 
-	err = vboxsf_call(SHFL_FN_INFORMATION, &parms, SHFL_CPARMS_INFORMATION,
-			  NULL);
+	err = vboxsf_sched_call(client, root, class, SHFL_FN_INFORMATION,
+				&parms, SHFL_CPARMS_INFORMATION, NULL);
 
 	*buf_len = parms.cb.u.value32;
 	return err;
@@ -320,10 +696,11 @@ int vboxsf_fsinfo(u32 root, u64 handle, u32 flags,
 int vboxsf_readlink(u32 root, struct shfl_string *parsed_path,
 		    u32 buf_len, u8 *buf)
 {
+	struct vboxsf_client *client = vboxsf_pick_client();
 	struct shfl_readLink parms;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.path.type = VMMDEV_HGCM_PARM_TYPE_LINADDR_KERNEL_IN;
 	parms.path.u.pointer.size = shfl_string_buf_size(parsed_path);
@@ -333,17 +710,19 @@ int vboxsf_readlink(u32 root, struct shfl_string *parsed_path,
 	parms.buffer.u.pointer.size = buf_len;
 	parms.buffer.u.pointer.u.linear_addr = (uintptr_t)buf;
 
-	return vboxsf_call(SHFL_FN_READLINK, &parms, SHFL_CPARMS_READLINK,
-			   NULL);
+	return vboxsf_sched_call(client, root, vboxsf_io_sync_meta,
+				 SHFL_FN_READLINK, &parms,
+				 SHFL_CPARMS_READLINK, NULL);
 }
 
 int vboxsf_symlink(u32 root, struct shfl_string *new_path,
 		   struct shfl_string *old_path, struct shfl_fsobjinfo *buf)
 {
+	struct vboxsf_client *client = vboxsf_pick_client();
 	struct shfl_symlink parms;
 
 	parms.root.type = VMMDEV_HGCM_PARM_TYPE_32BIT;
-	parms.root.u.value32 = root;
+	parms.root.u.value32 = vboxsf_client_root(client, root);
 
 	parms.new_path.type = VMMDEV_HGCM_PARM_TYPE_LINADDR_KERNEL_IN;
 	parms.new_path.u.pointer.size = shfl_string_buf_size(new_path);
@@ -357,15 +736,32 @@ int vboxsf_symlink(u32 root, struct shfl_string *new_path,
 	parms.info.u.pointer.size = sizeof(struct shfl_fsobjinfo);
 	parms.info.u.pointer.u.linear_addr = (uintptr_t)buf;
 
-	return vboxsf_call(SHFL_FN_SYMLINK, &parms, SHFL_CPARMS_SYMLINK, NULL);
+	return vboxsf_sched_call(client, root, vboxsf_io_sync_meta,
+				 SHFL_FN_SYMLINK, &parms,
+				 SHFL_CPARMS_SYMLINK, NULL);
+}
+
+/* These are per client settings, so they are applied to all clients */
+static int vboxsf_call_all(u32 function)
+{
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < vboxsf_nr_clients; i++) {
+		err = vboxsf_call(&vboxsf_clients[i], function, NULL, 0, NULL);
+		if (err)
+			return err;
+	}
+
+	return 0;
 }
 
 int vboxsf_set_utf8(void)
 {
-	return vboxsf_call(SHFL_FN_SET_UTF8, NULL, 0, NULL);
+	return vboxsf_call_all(SHFL_FN_SET_UTF8);
 }
 
 int vboxsf_set_symlinks(void)
 {
-	return vboxsf_call(SHFL_FN_SET_SYMLINKS, NULL, 0, NULL);
+	return vboxsf_call_all(SHFL_FN_SET_SYMLINKS);
 }
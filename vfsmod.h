@@ -10,16 +10,50 @@
 
 #include <linux/backing-dev.h>
 #include <linux/idr.h>
+#include <linux/kconfig.h>
+#include <linux/workqueue.h>
 #include "shfl_hostintf.h"
 
 #define DIR_BUFFER_SIZE SZ_16K
 
+/* Max. number of pages transferred with a single host read / write call */
+#define VBOXSF_MAX_IO_PAGES (SZ_1M / PAGE_SIZE)
+
+/* Max. number of concurrent stripes of a single read / write */
+#define VBOXSF_MAX_STRIPES 16
+
+/* Max. number of HGCM client connections to the host */
+#define VBOXSF_MAX_CLIENTS 16
+
+/* Number of SHFL_FN_* functions counted in struct vboxsf_stats */
+#define VBOXSF_NR_FNS (SHFL_FN_SET_SYMLINKS + 1)
+
 /* The cast is to prevent assignment of void * to pointers of arbitrary type */
 #define VBOXSF_SBI(sb)	((struct vboxsf_sbi *)(sb)->s_fs_info)
 #define VBOXSF_I(i)	container_of(i, struct vboxsf_inode, vfs_inode)
 
+/* Page-cache coherence modes for host side changes, see file.c */
+enum vboxsf_cache_mode {
+	vboxsf_cache_open,	/* Revalidate at open time only (default) */
+	vboxsf_cache_none,	/* Invalidate the read range on every read */
+	vboxsf_cache_strict,	/* Stat and compare mtime on every read */
+	vboxsf_cache_loose,	/* Trust the page-cache, never invalidate */
+};
+
+/* Host call classes for the request scheduler, in order of priority */
+enum vboxsf_io_class {
+	vboxsf_io_sync_meta,	/* Metadata calls somebody is waiting for */
+	vboxsf_io_sync_data,	/* Data calls somebody is waiting for */
+	vboxsf_io_readahead,
+	vboxsf_io_writeback,	/* Background writeback */
+	vboxsf_io_prefetch,	/* Speculative calls nobody is waiting for */
+	vboxsf_io_nr_classes
+};
+
 struct vboxsf_options {
 	unsigned long ttl;
+	unsigned long statfs_ttl;
+	enum vboxsf_cache_mode cache;
 	kuid_t uid;
 	kgid_t gid;
 	bool dmode_set;
@@ -28,8 +62,34 @@ struct vboxsf_options {
 	umode_t fmode;
 	umode_t dmask;
 	umode_t fmask;
+	bool fscache;
+	bool exclusive;
+	bool denywrite;
+	bool strictclose;
+	unsigned int stripes;
+	u32 stripe_size;
+};
+
+/* Per-CPU statistics of a mapped folder, see vboxsf_show_stats() */
+struct vboxsf_stats {
+	u64 calls[VBOXSF_NR_FNS];
+	u64 errors[VBOXSF_NR_FNS];
+	u64 bytes_read;
+	u64 bytes_written;
+	u64 attr_hits;
+	u64 attr_misses;
+	u64 neg_dentry_hits;
+	u64 neg_dentry_misses;
+	u64 listing_lookups;
+	u64 readahead_windows;
+	u64 readahead_pages;
+	u64 wb_batches;
+	u64 wb_pages;
 };
 
+#define vboxsf_stats_inc(sbi, field)	this_cpu_inc((sbi)->stats->field)
+#define vboxsf_stats_add(sbi, field, n)	this_cpu_add((sbi)->stats->field, n)
+
 struct vboxsf_fs_context {
 	struct vboxsf_options o;
 	char *nls_name;
@@ -45,22 +105,136 @@ struct vboxsf_sbi {
 	u32 next_generation;
 	u32 root;
 	int bdi_id;
+	/* statistics, shared with other mounts of the same folder */
+	struct vboxsf_stats __percpu *stats;
+	/* host file names are case sensitive, from the volume properties */
+	bool case_sensitive;
+	/* exclusive mode: cached info older than this gets revalidated */
+	unsigned long inval_time;
+	/* per mount workqueue for deferred closes, mmap unpin, aio etc. */
+	struct workqueue_struct *wq;
+	/* workqueue for the stripes of striped reads / writes */
+	struct workqueue_struct *stripe_wq;
+	/* workqueue for async writeback, flushed from sbi->wq work */
+	struct workqueue_struct *wb_wq;
+	/* handles waiting to be closed by close_work + lock protecting it */
+	struct list_head close_list;
+	spinlock_t close_lock;
+	struct work_struct close_work;
+	/* statfs cache: volume info + when it was read, see vboxsf_statfs */
+	struct shfl_volinfo volinfo;
+	unsigned long volinfo_time;
+	bool volinfo_valid;
+	spinlock_t volinfo_lock; /* This protects the volinfo fields */
+	struct work_struct volinfo_work;
+#if IS_ENABLED(CONFIG_FSCACHE)
+	struct fscache_cookie *fscache;
+#endif
 };
 
 /* per-inode information */
 struct vboxsf_inode {
 	/* some information was changed, update data on next revalidate */
 	int force_restat;
+	/* jiffies when the attributes were read from the host */
+	unsigned long attr_time;
+	/* host mtime + size after our last write, valid if own_write */
+	int own_write;
+	s64 own_mtime;
+	loff_t own_size;
+	/* we wrote to the host since own_mtime + own_size were recorded */
+	int own_write_pending;
 	/* list of open handles for this inode + lock protecting it */
 	struct list_head handle_list;
-	/* This mutex protects handle_list accesses */
+	/*
+	 * This mutex protects handle_list, dir_cache and lookup_* accesses
+	 * and updates of link, which is read under RCU.
+	 */
 	struct mutex handle_list_mutex;
+	/* number of open handles for which the host granted DENYWRITE */
+	int deny_write_count;
+	/* released handles not closed yet, protected by sbi->close_lock */
+	int close_count;
+	/* data was written to the host since the last host flush */
+	int needs_flush;
+	/* asynchronous writeback, flushes the file too if flush_requested */
+	struct work_struct wb_work;
+	int flush_requested;
+	/* fsync group commit: started flushes + result of the last one */
+	unsigned long flush_gen;
+	int flush_err;
+	/* This mutex serializes host flushes of the file */
+	struct mutex flush_mutex;
+	/* revalidate singleflight: completed stats + result of the last one */
+	unsigned long stat_gen;
+	int stat_err;
+	/* This mutex serializes revalidation stats of the inode */
+	struct mutex stat_mutex;
+	/* write handle pinned by shared writable mappings + mapping count */
+	struct vboxsf_handle *mmap_handle;
+	int mmap_count;
+	/* writes back and unpins mmap_handle after the last munmap */
+	struct work_struct mmap_work;
+	/* symlink target cache, see vboxsf_get_link() */
+	struct vboxsf_link __rcu *link;
+	/* exclusive mode: directory listing kept across opens */
+	struct vboxsf_dir_info *dir_cache;
+	/* listing answering lookups in a lookup-heavy dir, see dir.c */
+	struct vboxsf_dir_info *lookup_dir;
+	/* lookups in the current hotness window + start of the window */
+	unsigned int lookup_count;
+	unsigned long lookup_window;
+	/* bumped when lookup_dir is dropped, a listing is being fetched */
+	unsigned long lookup_gen;
+	int lookup_fetching;
+	/* host inode_id_device + inode_id, 0 if the host does not provide it */
+	u32 host_inode_id_device;
+	u64 host_inode_id;
+#if IS_ENABLED(CONFIG_FSCACHE)
+	struct fscache_cookie *fscache;
+	/* This mutex protects acquiring / enabling / disabling the cookie */
+	struct mutex fscache_lock;
+#endif
 	/* The VFS inode struct */
 	struct inode vfs_inode;
 };
 
+/* per open file handle information */
+struct vboxsf_handle {
+	u64 handle;
+	u32 root;
+	/* index of the HGCM client the handle was opened on */
+	u32 client_idx;
+	u32 access_flags;
+	bool deny_write;
+	struct kref refcount;
+	struct list_head head;
+	/* deferred close: entry in sbi->close_list */
+	struct list_head close_head;
+	/* deferred close: inode, holds a ref, and if it must be written back */
+	struct inode *close_inode;
+	bool close_wb;
+};
+
+struct vboxsf_link {
+	struct kref refcount;
+	struct rcu_head rcu;
+	/* symlink mtime + jiffies when the target was read from the host */
+	struct timespec64 mtime;
+	unsigned long read_time;
+	char target[];
+};
+
 struct vboxsf_dir_info {
 	struct list_head info_list;
+	struct kref refcount;
+	/* jiffies when the listing was read from the host */
+	unsigned long read_time;
+	/* directory mtime before the listing was read, for lookup_dir */
+	struct timespec64 mtime;
+	/* open addressed name index for lookup_dir, NULL if not built */
+	struct shfl_dirinfo **index;
+	unsigned int index_mask;
 };
 
 struct vboxsf_dir_buf {
@@ -80,15 +254,36 @@ extern const struct file_operations vboxsf_reg_fops;
 extern const struct address_space_operations vboxsf_reg_aops;
 extern const struct dentry_operations vboxsf_dentry_ops;
 
+/* from dir.c */
+int vboxsf_dir_listing_stat(struct dentry *dentry,
+			    struct shfl_fsobjinfo *fsinfo,
+			    unsigned long *read_time);
+
+/* from file.c */
+struct vboxsf_handle *vboxsf_get_handle(struct vboxsf_inode *sf_i);
+struct vboxsf_handle *vboxsf_get_read_handle(struct vboxsf_inode *sf_i);
+void vboxsf_put_handle(struct vboxsf_handle *sf_handle);
+void vboxsf_close_work(struct work_struct *work);
+void vboxsf_close_inode_handles(struct inode *inode);
+void vboxsf_mmap_work(struct work_struct *work);
+void vboxsf_wb_work(struct work_struct *work);
+void vboxsf_link_drop(struct inode *inode);
+
 /* from utils.c */
 struct inode *vboxsf_new_inode(struct super_block *sb);
 void vboxsf_init_inode(struct vboxsf_sbi *sbi, struct inode *inode,
 		       const struct shfl_fsobjinfo *info);
 int vboxsf_create_at_dentry(struct dentry *dentry,
-			    struct shfl_createparms *params);
+			    struct shfl_createparms *params, u32 *client_idx);
 int vboxsf_stat(struct vboxsf_sbi *sbi, struct shfl_string *path,
 		struct shfl_fsobjinfo *info);
 int vboxsf_stat_dentry(struct dentry *dentry, struct shfl_fsobjinfo *info);
+int vboxsf_stat_handle(struct vboxsf_handle *sf_handle,
+		       struct shfl_fsobjinfo *info);
+void vboxsf_note_own_write(struct inode *inode);
+void vboxsf_record_own_write(struct inode *inode,
+			     struct vboxsf_handle *sf_handle);
+bool vboxsf_exclusive_valid(struct dentry *dentry);
 int vboxsf_inode_revalidate(struct dentry *dentry);
 int vboxsf_getattr(const struct path *path, struct kstat *kstat,
 		   u32 request_mask, unsigned int query_flags);
@@ -99,32 +294,42 @@ int vboxsf_nlscpy(struct vboxsf_sbi *sbi, char *name, size_t name_bound_len,
 		  const unsigned char *utf8_name, size_t utf8_len);
 struct vboxsf_dir_info *vboxsf_dir_info_alloc(void);
 void vboxsf_dir_info_free(struct vboxsf_dir_info *p);
+void vboxsf_dir_info_put(struct vboxsf_dir_info *p);
+struct vboxsf_dir_info *vboxsf_dir_cache_get(struct inode *dir);
+void vboxsf_dir_cache_set(struct inode *dir, struct vboxsf_dir_info *p);
+void vboxsf_dir_cache_drop(struct inode *dir);
 int vboxsf_dir_read_all(struct vboxsf_sbi *sbi, struct vboxsf_dir_info *sf_d,
-			u64 handle);
+			u32 client_idx, u64 handle,
+			enum vboxsf_io_class class);
 
 /* from vboxsf_wrappers.c */
-int vboxsf_connect(void);
+int vboxsf_connect(unsigned int nr_clients);
 void vboxsf_disconnect(void);
 
 int vboxsf_create(u32 root, struct shfl_string *parsed_path,
-		  struct shfl_createparms *create_parms);
+		  struct shfl_createparms *create_parms, u32 *client_idx);
 
-int vboxsf_close(u32 root, u64 handle);
+int vboxsf_close(u32 root, u32 client_idx, u64 handle);
 int vboxsf_remove(u32 root, struct shfl_string *parsed_path, u32 flags);
 int vboxsf_rename(u32 root, struct shfl_string *src_path,
 		  struct shfl_string *dest_path, u32 flags);
 
-int vboxsf_read(u32 root, u64 handle, u64 offset, u32 *buf_len, u8 *buf);
-int vboxsf_write(u32 root, u64 handle, u64 offset, u32 *buf_len, u8 *buf);
+int vboxsf_read(u32 root, u32 client_idx, u64 handle, u64 offset,
+		u32 *buf_len, u8 *buf, enum vboxsf_io_class class);
+int vboxsf_write(u32 root, u32 client_idx, u64 handle, u64 offset,
+		 u32 *buf_len, u8 *buf, enum vboxsf_io_class class);
+int vboxsf_flush(u32 root, u32 client_idx, u64 handle);
 
-int vboxsf_dirinfo(u32 root, u64 handle,
+int vboxsf_dirinfo(u32 root, u32 client_idx, u64 handle,
 		   struct shfl_string *parsed_path, u32 flags, u32 index,
-		   u32 *buf_len, struct shfl_dirinfo *buf, u32 *file_count);
-int vboxsf_fsinfo(u32 root, u64 handle, u32 flags,
-		  u32 *buf_len, void *buf);
+		   u32 *buf_len, struct shfl_dirinfo *buf, u32 *file_count,
+		   enum vboxsf_io_class class);
+int vboxsf_fsinfo(u32 root, u32 client_idx, u64 handle, u32 flags,
+		  u32 *buf_len, void *buf, enum vboxsf_io_class class);
 
 int vboxsf_map_folder(struct shfl_string *folder_name, u32 *root);
 int vboxsf_unmap_folder(u32 root);
+struct vboxsf_stats __percpu *vboxsf_root_stats(u32 root);
 
 int vboxsf_readlink(u32 root, struct shfl_string *parsed_path,
 		    u32 buf_len, u8 *buf);
@@ -134,4 +339,39 @@ int vboxsf_symlink(u32 root, struct shfl_string *new_path,
 int vboxsf_set_utf8(void);
 int vboxsf_set_symlinks(void);
 
+/* from fscache.c */
+#if IS_ENABLED(CONFIG_FSCACHE)
+int vboxsf_fscache_register(void);
+void vboxsf_fscache_unregister(void);
+void vboxsf_fscache_get_session_cookie(struct vboxsf_sbi *sbi,
+				       const char *share_name);
+void vboxsf_fscache_put_session_cookie(struct vboxsf_sbi *sbi);
+void vboxsf_fscache_put_inode_cookie(struct inode *inode);
+void vboxsf_fscache_open(struct inode *inode, struct file *file);
+void vboxsf_fscache_invalidate(struct inode *inode);
+int vboxsf_fscache_readpage(struct inode *inode, struct page *page);
+void vboxsf_fscache_write_page(struct inode *inode, struct page *page);
+int vboxsf_fscache_release_page(struct page *page, gfp_t gfp);
+void vboxsf_fscache_invalidate_page(struct page *page);
+#else
+static inline int vboxsf_fscache_register(void) { return 0; }
+static inline void vboxsf_fscache_unregister(void) {}
+static inline void vboxsf_fscache_get_session_cookie(struct vboxsf_sbi *sbi,
+						     const char *share_name) {}
+static inline void vboxsf_fscache_put_session_cookie(struct vboxsf_sbi *sbi) {}
+static inline void vboxsf_fscache_put_inode_cookie(struct inode *inode) {}
+static inline void vboxsf_fscache_open(struct inode *inode,
+				       struct file *file) {}
+static inline void vboxsf_fscache_invalidate(struct inode *inode) {}
+static inline int vboxsf_fscache_readpage(struct inode *inode,
+					  struct page *page) { return 1; }
+static inline void vboxsf_fscache_write_page(struct inode *inode,
+					     struct page *page) {}
+static inline int vboxsf_fscache_release_page(struct page *page, gfp_t gfp)
+{
+	return 1;
+}
+static inline void vboxsf_fscache_invalidate_page(struct page *page) {}
+#endif
+
 #endif